@@ -1,5 +1,4 @@
-#define _POSIX_C_SOURCE 200809L
-#define MAX_INPUT 512
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <string.h>
@@ -15,43 +14,737 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// One shell variable, kept as a ready-made "NAME=value" environment entry
+struct var {
+  char *entry;     // NULL for a free slot
+  size_t name_len; // the value starts at entry + name_len + 1
+  bool exported;
+};
+
+// Open addressing hash table of the shell variables, plus the environment
+// handed to commands, rebuilt only after an exported variable changed
+struct var_store {
+  struct var *slots;
+  size_t capacity;  // always a power of two
+  size_t count;
+  char **envp;      // NULL terminated, points at the exported entries
+  size_t envp_cap;
+  bool envp_dirty;
+  unsigned long generation; // bumped whenever the exported set changes
+};
 
 // Struct to store env variables
 struct env_vars {
-  char *ifs;
-  char *ps1;
-  char *home_path;
-  char *smallsh_process_id;
-  char *last_fg_exec_return_val;
-  char *last_bg_exec_return_val;
+  struct var_store vars; // PS1, IFS, HOME, PATH and everything else by name
+
+  // Special parameters, kept as native values and only formatted when a word
+  // references them
+  pid_t shell_pid;       // $$
+  int last_status;       // $?, 128 + n after signal n
+  pid_t last_bg_pid;     // $!, 0 (expands empty) until something ran in the background
+  char const *arg0;      // $0
+  char **positional;     // $1 ... $#
+  int num_positional;
+  uint32_t random_state; // $RANDOM, xorshift32
+};
+
+// One chunk of memory handed out by an arena
+struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+  char data[] __attribute__((aligned(16))); // malloc() alignment, rounded sizes keep it
+};
+
+// Bump allocator for the strings of one command line, reset at the next prompt
+struct arena {
+  struct arena_block *head;
+};
+
+// What an epoll event refers to, kept in the upper half of epoll_data.u64
+enum event_kind {
+  EVENT_STDIN = 1,
+  EVENT_SIGCHLD,
+  EVENT_PIDFD, // the lower half holds the pid
+  EVENT_MUX    // the lower half holds the fd of a mux_stream
+};
+
+#define MUX_BUFFER (64 * 1024) // longer lines are cut
+#define MUX_IOV 512
+
+// One output stream of a background job under "set -o mux=1". Its pipe is
+// read as data arrives and only whole lines go out, each tagged with the job.
+struct mux_stream {
+  int fd;           // read end of the pipe, nonblocking
+  int target;       // STDOUT_FILENO or STDERR_FILENO
+  int job_id;
+  pid_t pid;        // last stage of the job, as in $!
+  size_t len;       // bytes of an unfinished line in buf
+  char buf[MUX_BUFFER];
+};
+
+// A child the event loop watches through its pidfd
+struct watched_child {
+  pid_t pid;
+  int pidfd;
+};
+
+// One epoll instance watching stdin, a signalfd for SIGCHLD and a pidfd per
+// child, shared by the prompt and the foreground wait
+struct event_loop {
+  int epfd;
+  int sigfd;
+  struct watched_child *children;
+  size_t len;
+  size_t cap;
+  pid_t *fg_pids;   // stages of the foreground pipeline, zeroed as they are reaped
+  size_t fg_count;
+  size_t fg_live;
+  pid_t fg_last;    // last stage, its status becomes $?
+  int fg_status;
+  struct rusage fg_usage; // summed over the foreground stages
+  bool fg_done;
+  bool fg_stopped;  // the foreground child stopped and was moved to the background
+  bool reported;    // a completion was printed since the flag was last cleared
+  struct parsed_tokens *fg_pt; // foreground command, becomes a job if it stops
+  struct mux_stream **streams; // output of background jobs under "set -o mux=1"
+  size_t num_streams;
+  size_t streams_cap;
+};
+
+// What the shell itself spends a command's time on, as the profiler sees it
+enum trace_phase {
+  PHASE_READ,    // reading a line, at a terminal this includes the typing
+  PHASE_COMPILE, // tokenizing and building the AST
+  PHASE_EXPAND,  // variables, substitutions, field splitting and globs
+  PHASE_PARSE,   // words into parsed_tokens
+  PHASE_LAUNCH,  // fork/spawn/zygote until the pid is back, exec included for spawn
+  PHASE_WAIT,    // for the foreground job
+  PHASE_BUILTIN, // a builtin run in the shell
+  NUM_PHASES
+};
+
+#define TRACE_EVENTS 32768   // a power of two, the ring keeps the most recent
+#define TRACE_BUCKETS 496    // 8 per power of two of nanoseconds, up to 2^64
+#define TRACE_DETAIL 16
+
+// One timed phase, the detail is the command it was for, cut short
+struct trace_event {
+  uint64_t start;          // CLOCK_MONOTONIC ns
+  uint64_t duration;       // ns
+  enum trace_phase phase;
+  char detail[TRACE_DETAIL];
+};
+
+// Ring of the latest phases, dumped as a Chrome trace, and a log-linear
+// histogram of every phase since the start or the last "stats -r". Lives in
+// static storage so recording never allocates.
+struct profiler {
+  struct trace_event events[TRACE_EVENTS];
+  uint64_t recorded;       // events ever recorded, the last TRACE_EVENTS are in the ring
+  uint64_t counts[NUM_PHASES][TRACE_BUCKETS];
+  uint64_t total[NUM_PHASES];
+  uint64_t max[NUM_PHASES];
+};
+
+// Lifecycle of an entry in the job table, stopped jobs are continued at once
+enum job_state {
+  JOB_QUEUED, // waiting for a slot under the "set -j" limit
+  JOB_RUNNING
+};
+
+// A background job, or a foreground one that was stopped and continued
+struct job {
+  int id;
+  pid_t pgid;                 // pid of the first stage, 0 while queued
+  pid_t *pids;                // one per stage, 0 once reaped or if it failed to start
+  size_t num_pids;
+  size_t live;                // stages still running
+  int status;                 // wait status of the last stage
+  struct rusage usage;        // summed over the stages reaped so far
+  enum job_state state;
+  char *command;              // command line as shown by jobs and fg
+  struct parsed_tokens *pt;   // copy of the command, launched when a slot frees
+  struct arena arena;         // owns command and pt
+  struct job *next_queued;
+};
+
+// Entry of the pid map, every stage of a job has one
+struct job_pid {
+  pid_t pid;
+  struct job *job;            // NULL for a free slot
+};
+
+// Jobs by number and by pid, plus the FIFO of jobs waiting for a slot
+struct job_table {
+  struct job **by_id;         // by_id[id - 1], NULL for a free number
+  size_t id_cap;
+  struct job_pid *by_pid;     // open addressing on pid, a power of two in size
+  size_t pid_cap;
+  size_t pid_count;
+  size_t unmapped;            // pids left out of by_pid when it could not grow
+  struct job *queue_head;
+  struct job *queue_tail;
+  size_t count;               // jobs in the table
+  size_t running;             // jobs holding a slot
+  size_t limit;               // most jobs running at once, 0 for no limit
+  int current_id;             // most recent job, the default for fg and bg
+  int wait_id;                // job the wait builtin is blocked on
+  bool wait_done;
+  int wait_status;
+};
+
+// A command the shell runs itself. Shell builtins change the shell's own state and
+// run only as a lone command, utilities stand in for external programs: in-process
+// with the redirections swapped in, forked inside a pipeline or in the background
+struct builtin {
+  char const *name;
+  void (*shell)(struct env_vars *env, struct parsed_tokens *pt);
+  int (*utility)(struct parsed_tokens *pt); // returns the exit status
+};
+
+// Which mechanism launch_command() uses to start external commands
+enum launch_engine {
+  LAUNCH_SPAWN, // posix_spawn(), a CLONE_VM|CLONE_VFORK child under glibc
+  LAUNCH_FORK,  // classic fork() + execvp(), kept as the fallback
+  LAUNCH_ZYGOTE // ask the zygote to start it, the shell itself never forks
+};
+
+// Helper forked before the shell grows, it starts commands on request over a
+// socketpair. Its children are made with CLONE_PARENT so they are the shell's.
+struct zygote {
+  pid_t pid;  // 0 when there is none or it was reaped
+  int sock;   // SOCK_SEQPACKET, -1 once the zygote is unusable
+  unsigned long env_generation; // environment the zygote last received
+};
+
+// Fixed part of a launch request. It is followed by NUL terminated strings: the
+// path ("" runs a utility builtin), argc words of argv, the input and output
+// redirection paths ("" for none), the cwd and envc environment entries. The
+// stdin, stdout and stderr the command gets travel as SCM_RIGHTS.
+struct zygote_request {
+  pid_t pgid;
+  bool foreground;
+  uint32_t argc;
+  int32_t envc; // -1 keeps the environment of the previous request
+  uint32_t num_redirs;
+};
+
+// Answer to a launch request, error is the errno of a failed exec
+struct zygote_reply {
+  pid_t pid;
+  int error;
+};
+
+// One command being started by the zygote, shared with the child it clones
+struct zygote_launch {
+  struct zygote_request req;
+  char const *path;
+  char **argv;
+  struct redirection const *redirs;
+  char **envp;
+  int fds[3];
+  int error; // set by the child when its exec fails
+};
+
+#define ZYGOTE_MAX_REQUEST 65536
+#define ZYGOTE_STACK_SIZE (64 * 1024)
+
+// One resolved command in the PATH lookup cache
+struct path_cache_entry {
+  char *name;        // command name as typed, NULL if the slot is free
+  char *path;        // absolute path it resolved to
+  unsigned int hits; // number of launches served from this entry
+};
+
+// Open addressing hash table mapping command names to absolute paths
+struct path_cache {
+  struct path_cache_entry *slots;
+  size_t capacity; // always a power of two
+  size_t count;
+  char *path_env;  // value of PATH the entries were resolved against
+};
+
+// Where command lines are read from
+enum input_kind {
+  INPUT_STDIN, // getline() on stdin, a terminal or a redirected file
+  INPUT_BUFFER // a whole script in memory, mmapped file or the -c string
+};
+
+// State of the line reader
+struct input_source {
+  enum input_kind kind;
+  bool interactive; // stdin is a terminal, prompt and handle signals
+  bool eof;
+  char *buf;        // INPUT_BUFFER: the script text
+  size_t len;
+  size_t pos;       // start of the next line in buf
+  size_t mapped;    // size of the mapping when buf is mmapped, else 0
+  bool owned;       // buf was malloced by open_script()
+  char *line;       // getline() buffer, also holds an unterminated last line
+  size_t n;
+};
+
+// Entries of the history index are grouped in blocks, the index keeps for
+// each hashed trigram (and bigram and byte, for short queries) a bitmap of
+// the blocks it occurs in
+#define HISTORY_BLOCK 32
+#define HISTORY_HASHES 4096
+
+// The history file, one command per line, only ever appended to. It stays
+// mapped, so startup reads nothing and Up walks back from the end; the
+// trigram index is built while the shell waits at the prompt.
+struct history {
+  int fd;                  // -1 without a history file
+  char *map;
+  size_t mapped;           // size of the mapping
+  size_t len;              // end of the last complete entry
+  size_t indexed;          // entries before this offset are in the index
+  size_t *blocks;          // offset of the first entry of each block
+  size_t num_blocks;
+  size_t blocks_cap;
+  size_t block_fill;       // entries in the last block
+  uint64_t *bits;          // HISTORY_HASHES rows of words_cap words
+  size_t words_cap;
+  bool index_failed;       // out of memory, the rest is searched without the index
+};
+
+// Keys the line editor reads as escape sequences
+enum edit_key {
+  KEY_UP = 256,
+  KEY_DOWN,
+  KEY_LEFT,
+  KEY_RIGHT,
+  KEY_HOME,
+  KEY_END,
+  KEY_DELETE
+};
+
+// The interactive line editor, the line is edited in place in the
+// input_source's getline() buffer
+struct line_editor {
+  bool enabled;            // stdin is a terminal that is not TERM=dumb
+  bool active;             // a line is being edited, redraw it after a report
+  char prompt[256];        // the prompt last shown, PS1 or PS2
+  struct input_source *in;
+  size_t len;
+  size_t pos;              // cursor
+  char *saved;             // the line being typed while Up shows older ones
+  size_t nav;              // history entry shown, history.len for the line itself
+  bool searching;          // in Ctrl-R
+  char query[128];
+  size_t query_len;
+  bool found;
+  size_t match;            // entry the search is on
+  int last_key;            // a second Tab in a row lists the choices
+};
+
+// A word of the input line, as a slice of the getline() buffer
+struct token_slice {
+  size_t offset;
+  size_t length;
+};
+
+// Growable vector of token slices, kept between lines so it only ever grows
+struct token_vec {
+  struct token_slice *items;
+  size_t len;
+  size_t cap;
+};
+
+// Growable vector of string pointers, kept between lines so it only ever grows
+struct ptr_vec {
+  char **items;
+  size_t len;
+  size_t cap;
+};
+
+// Kinds of name in a directory listing, kept in the byte before the name
+#define LISTING_DIR 1
+#define LISTING_EXEC 2
+#define COMPLETION_DIRS 64 // listings kept besides the PATH directories
+
+// The names in a directory, sorted, as of the directory's mtime
+struct dir_listing {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  bool executables;        // LISTING_EXEC was worked out, it costs a stat() per file
+  bool pinned;             // a PATH directory, never evicted
+  unsigned long generation; // bumped whenever it is read again
+  struct ptr_vec names;
+  struct arena arena;      // owns the names
+};
+
+// Directory listings for Tab, and the executables of PATH merged into one
+// sorted index. A Tab only stat()s the directories, one is read again when
+// its mtime changed.
+struct completion_cache {
+  struct dir_listing **dirs;
+  size_t len;
+  size_t cap;
+  char *path_env;          // PATH the command index is for
+  uint64_t stamp;          // of the listings the command index was merged from
+  struct ptr_vec commands;
+};
+
+// Kinds of node in a compiled program
+enum node_kind {
+  NODE_COMMAND,  // a pipeline, expanded and parsed each time it runs
+  NODE_AND,      // cond && body
+  NODE_OR,       // cond || body
+  NODE_IF,       // if cond then body else else_body fi, elif nests in else_body
+  NODE_WHILE,    // while or until cond do body done
+  NODE_FOR,      // for name in words do body done
+  NODE_FUNCTION  // name() { body }, defines the function when it runs
+};
+
+// A command of a compiled program, the words are kept unexpanded
+struct node {
+  enum node_kind kind;
+  struct node *next;      // next command of the list
+  char **words;           // NODE_COMMAND words, NODE_FOR word list
+  size_t num_words;
+  char *name;             // NODE_FOR variable, NODE_FUNCTION name
+  struct node *cond;      // the left side for NODE_AND and NODE_OR
+  struct node *body;
+  struct node *else_body;
+  bool until;             // NODE_WHILE runs while cond fails
+  bool has_in;            // NODE_FOR without "in" walks $1 ... $#
+};
+
+// A shell function, with its body copied out of the line it was defined on
+struct function {
+  char *name;
+  struct node *body;
+  struct arena arena;     // owns name and body
+  int running;            // calls in progress
+  bool defunct;           // redefined while running, freed when the last call returns
+  struct function *next;
+};
+
+// Reads input lines for the compiler. Words are NUL terminated in place and
+// separators come out as the sentinel tokens, a line that leaves a compound
+// command open pulls in the next one.
+struct lexer {
+  struct input_source *in;
+  char *line;
+  struct ptr_vec tokens;
+  size_t pos;
+  struct ptr_vec retired; // getline() buffers still referenced by the program
+  bool interrupted;       // Ctrl-C while reading a continuation line
+  struct heredoc *heredocs; // here-documents of the current line, read after it
+  size_t num_heredocs;
+  size_t heredocs_cap;
+  bool heredoc_next;      // "<<" stood alone, the next word is its delimiter
+  bool strip_tabs;        // of that one, "<<-"
+};
+
+// A here-document whose body is still to be read, the token at index holds
+// its delimiter until the body replaces it
+struct heredoc {
+  size_t index;
+  bool strip_tabs;
+};
+
+// Control flow state of the interpreter. break, continue and return unwind
+// the lists they are in until the loop or function that takes them.
+struct interp {
+  int loop_depth;
+  int func_depth;
+  int breaking;           // loops left to break out of
+  int continuing;         // loops left to leave, the last one continues
+  bool returning;
+  bool interrupted;       // a foreground command died of SIGINT
+};
+
+// Block buffer of "read" on a regular file. Lines are scanned in the buffer and
+// the file offset is put back after each one, so children see what is left.
+#define READ_BUFFER_SIZE (64 * 1024)
+struct read_buffer {
+  char *buf;
+  size_t cap;
+  size_t pos;     // next unread byte
+  size_t len;     // bytes in buf
+  off_t start;    // file offset of buf[0], -1 when the fd can not seek
+  bool valid;     // start and regular describe the fd
+  bool regular;   // block reads, else one byte at a time so nothing is taken from others
+};
+
+// Bytes that end a line or a field, the SIMD scan handles up to 4 of them
+struct delim_set {
+  bool member[256];
+  char bytes[4];
+  int count;      // 0 when there are more than 4, only the table is used then
+};
+
+// One step of a compiled glob component
+enum glob_kind { GLOB_CHAR, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
+struct glob_op {
+  unsigned char kind;
+  unsigned char c;        // GLOB_CHAR
+  bool negate;            // GLOB_CLASS: [!...] or [^...]
+  uint8_t const *set;     // GLOB_CLASS: 256 bit membership map
+};
+
+// A path component of a pattern, compiled once before any directory is read
+struct glob_component {
+  struct glob_op *ops;
+  size_t num_ops;
+  char const *literal;    // the unescaped text when there is nothing to match
+  char const *prefix;     // literal text every match starts with, and ends with
+  size_t prefix_len;
+  char const *suffix;
+  size_t suffix_len;
+  bool dot;               // the pattern starts with '.', hidden names may match
+};
+
+// getdents64() record, the same layout as the kernel's
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#define GLOB_DIRENT_BUFFER (256 * 1024)
+
+// Output of the command substitutions in the word being expanded. The measuring
+// pass runs them, the filling pass takes the results back in the same order.
+struct subst_result {
+  char *text;
+  size_t len;
+};
+struct subst_cache {
+  struct subst_result *items;
+  size_t len;
+  size_t cap;
+  size_t next;        // result the filling pass takes next
+  int status;         // of the last one, becomes $? once the word is done
+  size_t runs;        // substitutions run so far
+};
+
+// "[n]< path", "[n]> path", "[n]>> path", "[n]>&m" or "[n]>&-" for one fd,
+// "&> path" is a "> path" followed by "2>&1"
+struct redirection {
+  int fd;
+  int flags;          // open() flags of path
+  int source;         // without a path: the fd to duplicate onto fd, -1 closes fd
+  char *path;
+};
+
+// Fields of a placement that were given
+#define PLACE_CPUS 1
+#define PLACE_NICE 2
+#define PLACE_SCHED 4
+#define PLACE_CGROUP 8
+
+// Where and how a child runs: "@cpus=0-3 @nice=10 @sched=batch @cgroup=batch
+// @nofile=1024 cmd", or the defaults set with "place". Applied in the child
+// before the exec.
+struct placement {
+  unsigned set;            // PLACE_* of the fields given
+  cpu_set_t cpus;
+  int nice;
+  int policy;              // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE
+  char *cgroup;            // cgroup v2 path under /sys/fs/cgroup
+  unsigned limits_set;     // bit n for resource n
+  struct rlimit limits[RLIMIT_NLIMITS];
 };
 
 // Struct to store semantic tokens of the input string
 struct parsed_tokens {
   char *cmd;
-  char *cmd_args[MAX_INPUT];
-  char *input_for_execvp[MAX_INPUT + 1];
+  char **cmd_args;         // NULL terminated, the tail of input_for_execvp
+  char **input_for_execvp; // NULL terminated, allocated from the line arena
   bool will_run_in_bg; // if true, run the process in the background
-  char *input_redirection_path;
-  char *output_redirection_path;
+  struct redirection *redirs; // in the order they were written, applied after the pipe ends
+  size_t num_redirs;
+  char *input_data;        // here-document or here-string text fed to stdin
+  struct parsed_tokens *next_stage; // the command this one pipes into, NULL for the last
+  bool timed;                       // "time" prefix, report the resources used when done
+  struct timespec started;          // CLOCK_MONOTONIC launch time of the pipeline
+  struct placement *placement;      // "@name=value" words before the command, NULL for none
 };
 
 
-int parse_input(char **words, unsigned int num_words, struct parsed_tokens *pt);
+int parse_input(char **words, unsigned int num_words, struct parsed_tokens *pt, struct arena *a);
+int compile_line(struct lexer *lx, char *line, size_t len, struct node **program);
+void exec_list(struct env_vars *env, struct node *list);
+void exec_node(struct env_vars *env, struct node *node);
+void execute_simple_command(struct env_vars *env, char **words, size_t num_words);
+struct function *find_function(char const *name);
+void define_function(char const *name, struct node *body);
+void call_function(struct env_vars *env, struct function *fn, struct parsed_tokens *pt);
+struct node *copy_node(struct node const *src, struct arena *a);
+void execute_break_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_continue_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_return_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_read_command(struct env_vars *env, struct parsed_tokens *pt);
+ssize_t read_line(struct read_buffer *rb, int fd, char **line);
+void init_delim_set(struct delim_set *ds, char const *chars);
+char *scan_delims(char *p, size_t len, struct delim_set const *ds);
+int parse_stage(char **words, unsigned int num_words, struct parsed_tokens *pt, struct arena *a);
 void init_parsed_tokens_struct(struct parsed_tokens *pt);
-void free_parsed_tokens_struct(struct parsed_tokens *pt);
+int open_script(struct input_source *in, char const *path);
+ssize_t read_input_line(struct input_source *in, char **line);
+void close_input(struct input_source *in);
+void history_open(struct history *h, char const *path);
+bool history_map(struct history *h);
+void history_add(struct history *h, char const *line, size_t len);
+bool history_index(struct history *h, size_t budget);
+bool history_search(struct history *h, char const *query, size_t query_len, size_t before, size_t *entry);
+size_t history_entry_end(struct history const *h, size_t entry);
+ssize_t edit_line(struct line_editor *ed, struct input_source *in, char **line);
+void edit_refresh(struct line_editor *ed);
+void show_prompt(char const *prompt);
+void edit_complete(struct line_editor *ed);
+struct dir_listing *listing_read(struct completion_cache *cc, char const *dir, bool executables);
+struct ptr_vec *completion_commands(struct completion_cache *cc);
+size_t tokenize(char const *line, size_t len, char const *delims, struct token_vec *tv);
+bool token_vec_push(struct token_vec *tv, size_t offset, size_t length);
+bool ptr_vec_push(struct ptr_vec *v, char *ptr);
 void print_parsed_tokens_struct(struct parsed_tokens *pt);
 void print_env_struct(struct env_vars *env);
+void execute_export_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_unset_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_assignments(struct env_vars *env, struct parsed_tokens *pt);
 void execute_cd_command(struct env_vars *env, struct parsed_tokens *pt);
 void execute_exit_command(struct env_vars *env, struct parsed_tokens *pt);
 void execute_other_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_hash_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_jobs_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_wait_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_fg_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_bg_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_set_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_place_command(struct env_vars *env, struct parsed_tokens *pt);
+struct builtin const *find_builtin(char const *name);
+int run_utility(struct builtin const *builtin, struct parsed_tokens *pt);
+int builtin_echo(struct parsed_tokens *pt);
+int builtin_true(struct parsed_tokens *pt);
+int builtin_false(struct parsed_tokens *pt);
+int builtin_printf(struct parsed_tokens *pt);
+int builtin_test(struct parsed_tokens *pt);
+int builtin_pwd(struct parsed_tokens *pt);
+int builtin_cat(struct parsed_tokens *pt);
+bool utility_applies(struct builtin const *builtin, struct parsed_tokens const *pt);
+size_t launch_pipeline(struct parsed_tokens *pt, pid_t *pids, bool foreground, int *mux_fds);
+size_t count_stages(struct parsed_tokens *pt);
+pid_t launch_command(struct parsed_tokens *pt, pid_t pgid, int in_fd, int out_fd, int err_fd, bool foreground);
+pid_t launch_spawn(struct parsed_tokens *pt, char const *path, pid_t pgid, int in_fd, int out_fd, int err_fd,
+                   bool foreground);
+pid_t launch_fork(struct parsed_tokens *pt, char const *path, pid_t pgid, int in_fd, int out_fd, int err_fd,
+                  bool foreground);
+void exec_child(struct parsed_tokens *pt, char const *path, int in_fd, int out_fd, int err_fd,
+                struct placement const *place) __attribute__((noreturn));
+int parse_placement(char const *word, struct placement *place);
+bool placement_applies(struct parsed_tokens const *pt, bool foreground);
+bool placement_for(struct parsed_tokens const *pt, bool foreground, struct placement *place);
+int apply_placement(struct placement const *place);
+void print_placement(FILE *out, struct placement const *place);
+int open_input_data(char const *data);
+int apply_redirections(struct redirection const *redirs, size_t n, int *saved);
+void restore_redirections(struct redirection const *redirs, size_t n, int *saved);
+int format_redirection(char *buf, struct redirection const *r);
+int copy_fd(int in, int out);
+pid_t launch_zygote(struct parsed_tokens *pt, char const *path, pid_t pgid, int in_fd, int out_fd, int err_fd,
+                    bool foreground);
+int start_zygote(struct zygote *z, bool interactive);
+void zygote_main(int sock, bool interactive);
+
+struct path_cache_entry *path_cache_lookup(struct path_cache *pc, char const *name);
+void path_cache_forget(struct path_cache *pc, char const *name);
+void path_cache_clear(struct path_cache *pc);
+char *resolve_command_path(char const *name, char const *path_env);
+
+size_t var_name_length(char const *str);
+struct var *var_lookup(struct var_store *vs, char const *name, size_t name_len);
+char const *var_get(struct var_store *vs, char const *name);
+bool var_set(struct var_store *vs, char const *name, size_t name_len, char const *value);
+void var_export(struct var_store *vs, struct var *v);
+void var_unset(struct var_store *vs, char const *name);
+char **var_envp(struct var_store *vs);
 
-char *str_gsub(char **haystack, char const *needle, char const *sub);
 void print_prompt(struct env_vars *env);
 void init_env_vars(struct env_vars *env);
 void free_env_vars_struct(struct env_vars *env);
-void expand_variables(char **split_words, unsigned int num_words, struct env_vars *env);
-void update_env_vars_bg_return_vals(struct env_vars *env);
+void expand_variables(char **split_words, unsigned int num_words, struct env_vars *env, struct arena *a);
+char *expand_word(char const *word, struct env_vars *env, struct arena *a);
+size_t expand_word_into(char const *word, struct env_vars *env, char *out);
+char const *special_param(struct env_vars *env, char const *name, size_t name_len, char *buf,
+                          uint32_t *random_state);
+size_t expand_fields(char **source, char **words, size_t num_words, struct ptr_vec *out, struct env_vars *env,
+                     struct arena *a);
+bool expand_field(char const *source, char *word, struct ptr_vec *out, struct env_vars *env, struct arena *a);
+void run_substitution(struct env_vars *env, char const *text, size_t len, struct subst_result *result);
+void run_subshell(struct env_vars *env, char const *text, size_t len) __attribute__((noreturn));
+bool glob_word(char *word, struct ptr_vec *out, struct arena *a);
+void update_last_fg_status(struct env_vars *env, int status);
+void update_last_bg_pid(struct env_vars *env, pid_t pid);
+
+void init_event_loop(struct event_loop *ev, bool watch_stdin);
+void watch_child(struct event_loop *ev, pid_t pid);
+void mux_watch(struct event_loop *ev, int fd, int target, int job_id, pid_t pid);
+void mux_drain(struct event_loop *ev);
+void unwatch_child(struct event_loop *ev, pid_t pid);
+int service_events(struct event_loop *ev, struct env_vars *env, int timeout);
+int wait_for_input(struct event_loop *ev, struct env_vars *env);
+bool wait_foreground(struct event_loop *ev, struct env_vars *env, pid_t *pids, size_t count, pid_t pgid,
+                     struct parsed_tokens *pt, int *status);
+void handle_child_status(struct event_loop *ev, struct env_vars *env, pid_t pid, int status, struct rusage *ru);
+void rusage_add(struct rusage *total, struct rusage const *ru);
+void print_time_report(struct timespec const *started, struct rusage const *ru);
+uint64_t trace_begin(void);
+uint64_t trace_end(enum trace_phase phase, uint64_t start, char const *detail);
+int write_trace(FILE *out);
+void dump_trace(void);
+void execute_trace_command(struct env_vars *env, struct parsed_tokens *pt);
+void execute_stats_command(struct env_vars *env, struct parsed_tokens *pt);
+void write_acct_record(struct parsed_tokens *stage, pid_t pid, int status, struct timespec const *started,
+                       struct rusage const *ru);
+
+struct job *job_create(struct job_table *jt, struct parsed_tokens *pt);
+void job_started(struct job_table *jt, struct job *job, pid_t *pids, size_t count);
+bool job_launch(struct job_table *jt, struct event_loop *ev, struct env_vars *env, struct job *job, bool foreground);
+struct job *job_child_done(struct job_table *jt, pid_t pid, int status);
+void signal_job(struct job *job, int sig);
+void job_enqueue(struct job_table *jt, struct job *job);
+void job_dequeue(struct job_table *jt, struct job *job);
+void job_remove(struct job_table *jt, struct job *job, int status);
+struct job *job_by_id(struct job_table *jt, int id);
+struct job *job_by_pid(struct job_table *jt, pid_t pid);
+struct job *job_from_spec(struct job_table *jt, char const *spec);
+bool job_slot_free(struct job_table *jt);
+void schedule_jobs(struct job_table *jt, struct event_loop *ev, struct env_vars *env);
+struct parsed_tokens *copy_parsed_tokens(struct parsed_tokens const *src, struct arena *a);
+
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strdup(struct arena *a, char const *str);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
 
 /* Our signal handler for SIGINT */
 void handle_SIGINT(int signo) {
@@ -64,99 +757,212 @@ void handle_SIGTSTP(int signo) {
 }
 
 // Global Variables
+extern char **environ;
 struct env_vars env;
 struct parsed_tokens pt;
+enum launch_engine launch_engine = LAUNCH_SPAWN;
+struct path_cache path_cache;
+struct arena line_arena;
+struct token_vec line_tokens;
+struct ptr_vec line_words;
+struct ptr_vec glob_words;  // line_words after pathname expansion
+struct arena ast_arena;   // program compiled from the current input line
+struct lexer lexer;
+struct function *functions;
+struct interp interp;
+struct event_loop events;
+struct job_table job_table;
+bool job_control;     // interactive, every job gets its own process group and the terminal
+size_t pipe_size;     // F_SETPIPE_SZ for pipeline pipes, 0 keeps the kernel default
+int acct_fd = -1;     // "set -o acct=FILE" log, one JSON line per finished command
+char *acct_path;
+sigset_t shell_sigmask; // mask to hand to children, SIGCHLD is blocked in the shell
+struct zygote zygote = {0, -1, 0};
+bool mux_output;       // "set -o mux=1" tags the lines of background jobs
+bool profiling;       // "set -o profile=1" times the shell's phases for "stats" and "trace"
+bool builtin_utilities = true; // "set -o builtins=0" runs echo, test etc. as external commands
+struct read_buffer stdin_buffer; // "read" on the shell's stdin
+struct subst_cache substitutions;
+bool in_subshell;     // this process runs a command substitution
+bool subshell_exec;   // the substitution is one simple command, exec it in place
+struct history history = {-1};
+struct line_editor editor;
+struct completion_cache completions;
+struct placement job_placement[2]; // "place fg" and "place bg" defaults
+struct profiler profiler;
+
+static struct builtin const builtins[] = {
+  {"exit", execute_exit_command, NULL},
+  {"cd", execute_cd_command, NULL},
+  {"hash", execute_hash_command, NULL},
+  {"jobs", execute_jobs_command, NULL},
+  {"wait", execute_wait_command, NULL},
+  {"fg", execute_fg_command, NULL},
+  {"bg", execute_bg_command, NULL},
+  {"set", execute_set_command, NULL},
+  {"place", execute_place_command, NULL},
+  {"trace", execute_trace_command, NULL},
+  {"stats", execute_stats_command, NULL},
+  {"export", execute_export_command, NULL},
+  {"unset", execute_unset_command, NULL},
+  {"break", execute_break_command, NULL},
+  {"continue", execute_continue_command, NULL},
+  {"return", execute_return_command, NULL},
+  {"read", execute_read_command, NULL},
+  {"echo", NULL, builtin_echo},
+  {"true", NULL, builtin_true},
+  {"false", NULL, builtin_false},
+  {"printf", NULL, builtin_printf},
+  {"test", NULL, builtin_test},
+  {"[", NULL, builtin_test},
+  {"pwd", NULL, builtin_pwd},
+  {"cat", NULL, builtin_cat},
+};
 
 
-int main(void) {
+int main(int argc, char *argv[]) {
 
-  // CTRL-C on terminal
-  struct sigaction SIGINT_old_action;
-  struct sigaction SIGINT_action = {0};
-  SIGINT_action.sa_handler = handle_SIGINT;
-  SIGINT_action.sa_flags = 0;
-  sigfillset(&SIGINT_action.sa_mask);
-  if (sigaction(SIGINT, &SIGINT_action, &SIGINT_old_action) < 0) {
-    perror("Could not set SIGINT handler");
-    exit(EXIT_FAILURE);
+  struct input_source input = {0};
+  input.kind = INPUT_STDIN;
+
+  // "smallsh -c cmd" runs cmd, "smallsh script" runs the file, otherwise read stdin
+  if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+    input.kind = INPUT_BUFFER;
+    input.buf = argv[2];
+    input.len = strlen(argv[2]);
+  }
+  else if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+    fprintf(stderr, "smallsh: -c requires an argument\n");
+    exit(2);
+  }
+  else if (argc > 1) {
+    if (open_script(&input, argv[1]) < 0) {
+      fprintf(stderr, "smallsh: %s: %s\n", argv[1], strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  else {
+    input.interactive = isatty(STDIN_FILENO);
   }
 
-  // CTRL-Z on terminal
-  struct sigaction SIGTSTP_old_action;
-  struct sigaction SIGTSTP_action = {0};
-  SIGTSTP_action.sa_handler = handle_SIGTSTP;
-  sigfillset(&SIGTSTP_action.sa_mask);
-  SIGTSTP_action.sa_flags = 0;
-  if (sigaction(SIGTSTP, &SIGTSTP_action, &SIGTSTP_old_action) < 0 ) {
-    perror("Couldn't set SIGTSTP handler");
-    exit(EXIT_FAILURE);
+  // SMALLSH_LAUNCH=fork forces the fork() path, e.g. for benchmarking, and
+  // SMALLSH_LAUNCH=zygote starts the zygote now while the shell is still small
+  char *engine = getenv("SMALLSH_LAUNCH");
+  if (engine != NULL && strcmp(engine, "fork") == 0)
+    launch_engine = LAUNCH_FORK;
+  if (engine != NULL && strcmp(engine, "zygote") == 0) {
+    if (start_zygote(&zygote, input.interactive) == 0)
+      launch_engine = LAUNCH_ZYGOTE;
+    else
+      perror("Could not start the zygote");
   }
-  
 
+  // Scripts keep the default signal dispositions, only an interactive shell
+  // survives CTRL-C and CTRL-Z
+  if (input.interactive) {
+    struct sigaction SIGINT_action = {0};
+    SIGINT_action.sa_handler = handle_SIGINT;
+    SIGINT_action.sa_flags = 0;
+    sigfillset(&SIGINT_action.sa_mask);
+    if (sigaction(SIGINT, &SIGINT_action, NULL) < 0) {
+      perror("Could not set SIGINT handler");
+      exit(EXIT_FAILURE);
+    }
+
+    struct sigaction SIGTSTP_action = {0};
+    SIGTSTP_action.sa_handler = handle_SIGTSTP;
+    sigfillset(&SIGTSTP_action.sa_mask);
+    SIGTSTP_action.sa_flags = 0;
+    if (sigaction(SIGTSTP, &SIGTSTP_action, NULL) < 0 ) {
+      perror("Couldn't set SIGTSTP handler");
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  char *split_words[MAX_INPUT];
   char *line = NULL;
-  size_t n = 0;
 
   init_env_vars(&env);
 
+  // "smallsh script args..." and "smallsh -c cmd [name args...]" set $0 and
+  // the positional parameters
+  env.arg0 = argv[0];
+  if (input.kind == INPUT_BUFFER && argc > 1 && strcmp(argv[1], "-c") == 0) {
+    if (argc > 3)
+      env.arg0 = argv[3];
+    env.positional = argv + 4;
+    env.num_positional = argc > 4 ? argc - 4 : 0;
+  }
+  else if (argc > 1) {
+    env.arg0 = argv[1];
+    env.positional = argv + 2;
+    env.num_positional = argc - 2;
+  }
 
-start:
-  while (true) {
+  init_event_loop(&events, input.interactive);
+  lexer.in = &input;
 
-    int status = -1;
-    pid_t bgChildPid = -5;
+  // A terminal gets the line editor and the history in $HISTFILE, by default
+  // ~/.smallsh_history
+  if (input.interactive) {
+    char const *term = getenv("TERM");
+    editor.enabled = term == NULL || strcmp(term, "dumb") != 0;
+    // Lines read ahead into stdio's buffer would wait for the epoll loop to
+    // see fd 0 readable again, so getline() and "read" take bytes straight
+    // from the terminal
+    setvbuf(stdin, NULL, _IONBF, 0);
+    char const *histfile = var_get(&env.vars, "HISTFILE");
+    char const *home = var_get(&env.vars, "HOME");
+    char *path = NULL;
+    if (histfile == NULL && home != NULL && asprintf(&path, "%s/.smallsh_history", home) < 0)
+      path = NULL;
+    if (histfile != NULL || path != NULL)
+      history_open(&history, histfile ? histfile : path);
+    free(path);
+  }
 
-    // Check if any background child processes have finished or signalled
-    while((bgChildPid = waitpid(0, &status, WNOHANG | WUNTRACED)) > 0) {
+  // With job control the shell hands the terminal to each foreground job and
+  // must not be stopped when it takes it back
+  job_control = input.interactive;
+  if (job_control)
+    signal(SIGTTOU, SIG_IGN);
 
-      if (WIFEXITED(status)) {
-			  fprintf(stderr, "Child process %jd done. Exit status %d\n", (intmax_t)bgChildPid, WEXITSTATUS(status));
-      }
-      else if (WIFSIGNALED(status)) {
-	      fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t)bgChildPid, WTERMSIG(status));
-      }
-      else {
-        if (WIFSTOPPED(status)) {
-          // check if it is stopped, send a SIGCONT, the child will signal a SIGCHLD if it is stopped
-            fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t)bgChildPid);
-            kill(bgChildPid, SIGCONT);
-            // Update $!
-            free(env.last_bg_exec_return_val);
-            env.last_bg_exec_return_val = NULL;
-
-            char *tmp_str = (char *)malloc(sizeof(char) * 8);
-            sprintf(tmp_str, "%d", getpid());
-
-            env.last_bg_exec_return_val = strdup(tmp_str);
-            free(tmp_str);
-        }
-      }
-    }
+
+start:
+  while (true) {
+
+    // Report background children that finished while the last command ran
+    service_events(&events, &env, 0);
       
-    // Initialize the parsed tokens struct    
+    // Initialize the parsed tokens struct and drop everything the last line
+    // compiled and allocated
     init_parsed_tokens_struct(&pt);
+    arena_reset(&line_arena);
+    arena_reset(&ast_arena);
+    for (size_t i = 0; i < lexer.retired.len; i++)
+      free(lexer.retired.items[i]);
+    lexer.retired.len = 0;
+    memset(&interp, 0, sizeof interp);
 
     // Prompt user for input
-    print_prompt(&env);
-   
-    // Make SIG_INT run here only
-	  SIGINT_action.sa_handler = handle_SIGINT;
-	  sigaction(SIGINT, &SIGINT_action, &SIGINT_old_action);
+    if (input.interactive)
+      print_prompt(&env);
     
-    // Get the line of input from a user
-    ssize_t line_length;
-    if ((line_length = getline(&line, &n, stdin)) == -1) {
+    // Get the line of input from a user, at a terminal children that finish
+    // while we wait for it are reported right away (the line editor waits
+    // for each key itself, in raw mode)
+    ssize_t line_length = -1;
+    uint64_t read_start = trace_begin();
+    if ((input.interactive && !editor.enabled && wait_for_input(&events, &env) < 0) ||
+        (line_length = read_input_line(&input, &line)) == -1) {
       // Reset errno if an interrupt signal came through
       if (errno == EINTR) {
         clearerr(stdin);
         fprintf(stderr, "\n");
         errno = 0;
-        free_parsed_tokens_struct(&pt);
         goto start;
       }
       // Check for EOF, exit if found
-      else if (feof(stdin)) {
+      else if (input.eof) {
         execute_exit_command(&env, &pt);
       }
       // Log any error to the user
@@ -165,555 +971,6668 @@ start:
         exit(EXIT_FAILURE);
       }
     }
-	  
-    // Reset SIGINT handler to normal
-    sigaction(SIGINT, &SIGINT_old_action, NULL); 
+    uint64_t compile_start = trace_end(PHASE_READ, read_start, NULL);
+
+    // Compile the line, and the lines after it while a compound command is
+    // still open, then run it. Nothing is expanded until a command runs.
+    struct node *program = NULL;
+    int compiled = compile_line(&lexer, line, line_length, &program);
+    trace_end(PHASE_COMPILE, compile_start, NULL);
+    if (compiled == -2)
+      goto exit;
+    if (compiled < 0) {
+      update_last_fg_status(&env, (lexer.interrupted ? 130 : 2) << 8);
+      goto start;
+    }
+    exec_list(&env, program);
+  }
+ 
+exit:
+  if (env.shell_pid == getpid()) {
+    free_env_vars_struct(&env);
+    path_cache_clear(&path_cache);
+    free(path_cache.slots);
+  }
+  arena_free(&line_arena);
+  arena_free(&ast_arena);
+  free(line_tokens.items);
+  free(line_words.items);
+  free(glob_words.items);
+  close_input(&input);
+
+  return 0;
+}
+
+
+// Expands, parses and runs one command of a compiled program. The words are
+// left as compiled, so a loop body can run again.
+void execute_simple_command(struct env_vars *env, char **words, size_t num_words) {
+
+  // Only the first command of a substitution may take over its process
+  bool exec_here = subshell_exec;
+  subshell_exec = false;
+
+  // Each command starts from an empty arena
+  init_parsed_tokens_struct(&pt);
+  arena_reset(&line_arena);
+  line_words.len = 0;
+  for (size_t i = 0; i < num_words; i++) {
+    if (!ptr_vec_push(&line_words, words[i])) {
+      fprintf(stderr, "Error growing the word vector!\n");
+      return;
+    }
+  }
+  char **split_words = line_words.items;
+  size_t substitutions_before = substitutions.runs;
+
+  // Expand any variables and command substitutions in the user input, then
+  // split what substitutions printed and expand patterns into pathnames
+  uint64_t phase_start = trace_begin();
+  expand_variables(split_words, num_words, env, &line_arena);
+  num_words = expand_fields(words, split_words, num_words, &glob_words, env, &line_arena);
+  split_words = glob_words.items;
+  phase_start = trace_end(PHASE_EXPAND, phase_start, num_words ? split_words[0] : NULL);
+
+  // Ctrl-C in a command substitution abandons the command
+  if (interp.interrupted) {
+    update_last_fg_status(env, 130 << 8);
+    return;
+  }
+  
+  // Parse the user input into the pt struct, a malformed line only fails itself
+  int parsed = parse_input(split_words, num_words, &pt, &line_arena);
+  phase_start = trace_end(PHASE_PARSE, phase_start, pt.cmd);
+  if (parsed < 0) {
+    update_last_fg_status(env, 2 << 8);
+    return;
+  }
+
+  // Nothing to run if the words were only a comment
+  if (pt.cmd == NULL)
+    return;
+
+  // Builtins and functions run in the shell itself only as a single command
+  if (pt.next_stage != NULL)
+    goto launch;
+
+  // What runs in the shell itself has no child to place
+  struct function *fn = find_function(pt.cmd);
+  struct builtin const *builtin = find_builtin(pt.cmd);
+  bool assignment = var_name_length(pt.cmd) > 0 && pt.cmd[var_name_length(pt.cmd)] == '=';
+  if (pt.placement && (fn || assignment || (builtin && builtin->shell))) {
+    fprintf(stderr, "Error, %s runs in the shell and cannot be placed.\n", pt.cmd);
+    update_last_fg_status(env, 2 << 8);
+    return;
+  }
+
+  if (fn != NULL) {
+    call_function(env, fn, &pt);
+    return;
+  }
+
+  // NAME=value words set shell variables
+  if (assignment) {
+    execute_assignments(env, &pt);
+    // "x=$(cmd)" has the status of cmd
+    if (substitutions.runs != substitutions_before && env->last_status == 0)
+      env->last_status = substitutions.status;
+    return;
+  }
+ 
+  // Shell builtins always run here, utilities only in the foreground and
+  // untimed, so "time" and "&" still measure and detach a real child, and
+  // unplaced, so the placement has a child to apply to
+  if (builtin != NULL && builtin->shell != NULL) {
+    builtin->shell(env, &pt);
+    trace_end(PHASE_BUILTIN, phase_start, pt.cmd);
+    return;
+  }
+  if (builtin != NULL && !pt.will_run_in_bg && !pt.timed && !placement_applies(&pt, true) &&
+      utility_applies(builtin, &pt)) {
+    int status = run_utility(builtin, &pt);
+    trace_end(PHASE_BUILTIN, phase_start, pt.cmd);
+    update_last_fg_status(env, status << 8);
+    return;
+  }
+
+launch:
+  // A substitution's only command replaces the forked shell, nothing comes back
+  if (exec_here && pt.next_stage == NULL && !pt.will_run_in_bg && !pt.timed) {
+    char const *path = pt.input_for_execvp[0];
+    struct path_cache_entry *entry = strchr(path, '/') ? NULL : path_cache_lookup(&path_cache, path);
+    struct placement place;
+    bool placed = placement_for(&pt, true, &place);
+    // A here-document is still fed on stdin, if it can't be opened the
+    // normal launch below reports the error
+    int data_fd = pt.input_data ? open_input_data(pt.input_data) : -1;
+    if ((entry != NULL || strchr(path, '/')) && (data_fd != -1 || pt.input_data == NULL))
+      exec_child(&pt, entry ? entry->path : path, data_fd, -1, -1, placed ? &place : NULL);
+    if (data_fd != -1)
+      close(data_fd);
+  }
+
+  // Background commands over the "set -j" limit wait in the job queue
+  if (pt.will_run_in_bg && !job_slot_free(&job_table)) {
+    struct job *job = job_create(&job_table, &pt);
+    if (job)
+      job_enqueue(&job_table, job);
+    return;
+  }
+
+  // Launch the non built in command, every stage of a pipeline at once
+  size_t num_stages = count_stages(&pt);
+  pid_t *pids = arena_alloc(&line_arena, num_stages * sizeof *pids);
+  int mux_fds[2] = {-1, -1};
+  size_t started = launch_pipeline(&pt, pids, !pt.will_run_in_bg, pt.will_run_in_bg && mux_output ? mux_fds : NULL);
+  // A last stage that failed to start reads as a child that exited with 1
+  int childStatus = pids[num_stages - 1] ? 0 : 1 << 8;
+
+  if (started == 0) {
+    if (!pt.will_run_in_bg)
+      update_last_fg_status(env, childStatus);
+    for (int i = 0; i < 2; i++) {
+      if (mux_fds[i] != -1)
+        close(mux_fds[i]);
+    }
+  }
+  else if (pt.will_run_in_bg) {
+    // Update $! to be the PID of the last stage, the event loop reaps them all
+    struct job *job = job_create(&job_table, &pt);
+    for (size_t i = 0; i < num_stages; i++) {
+      if (pids[i]) {
+        watch_child(&events, pids[i]);
+        update_last_bg_pid(env, pids[i]);
+      }
+    }
+    if (job)
+      job_started(&job_table, job, pids, num_stages);
+    mux_watch(&events, mux_fds[0], STDOUT_FILENO, job ? job->id : 0, env->last_bg_pid);
+    mux_watch(&events, mux_fds[1], STDERR_FILENO, job ? job->id : 0, env->last_bg_pid);
+  }
+  else {
+    // Wait in the event loop so background children are still reaped meanwhile,
+    // a pipeline that stopped was moved to the background and leaves $? alone
+    phase_start = trace_begin();
+    bool finished = wait_foreground(&events, env, pids, num_stages, 0, &pt, &childStatus);
+    trace_end(PHASE_WAIT, phase_start, pt.cmd);
+    if (finished)
+      update_last_fg_status(env, childStatus);
+    if (pt.timed && !events.fg_stopped)
+      print_time_report(&pt.started, &events.fg_usage);
+    // Ctrl-C on a command inside a loop or function stops the whole program
+    if (WIFSIGNALED(childStatus) && WTERMSIG(childStatus) == SIGINT)
+      interp.interrupted = true;
+  }
+}
+
+
+// Runs a compiled command list, stopping early while a break, continue or
+// return unwinds it or after Ctrl-C
+void exec_list(struct env_vars *env, struct node *list) {
+  for (; list != NULL; list = list->next) {
+    if (interp.breaking || interp.continuing || interp.returning || interp.interrupted)
+      return;
+    exec_node(env, list);
+  }
+}
+
+
+// After one pass through a loop body, true if the loop has to stop
+static bool loop_done(void) {
+  if (interp.breaking) {
+    interp.breaking--;
+    return true;
+  }
+  if (interp.continuing && --interp.continuing > 0)
+    return true;
+  return interp.returning || interp.interrupted;
+}
+
+
+void exec_node(struct env_vars *env, struct node *node) {
+
+  switch (node->kind) {
+    case NODE_COMMAND:
+      execute_simple_command(env, node->words, node->num_words);
+      break;
+
+    case NODE_AND:
+    case NODE_OR:
+      exec_node(env, node->cond);
+      if ((env->last_status == 0) == (node->kind == NODE_AND))
+        exec_list(env, node->body);
+      break;
+
+    case NODE_IF:
+      exec_list(env, node->cond);
+      if (interp.breaking || interp.continuing || interp.returning || interp.interrupted)
+        break;
+      if (env->last_status == 0)
+        exec_list(env, node->body);
+      else if (node->else_body)
+        exec_list(env, node->else_body);
+      else
+        env->last_status = 0;
+      break;
+
+    case NODE_WHILE: {
+      int status = 0;
+      interp.loop_depth++;
+      while (true) {
+        // Background jobs are still reported while a long loop runs
+        service_events(&events, env, 0);
+        exec_list(env, node->cond);
+        if (interp.breaking || interp.continuing || interp.returning || interp.interrupted) {
+          if (loop_done())
+            break;
+          continue;
+        }
+        if ((env->last_status == 0) == node->until)
+          break;
+        exec_list(env, node->body);
+        status = env->last_status;
+        if (loop_done())
+          break;
+      }
+      interp.loop_depth--;
+      env->last_status = status;
+      break;
+    }
+
+    case NODE_FOR: {
+      // The words are expanded once, before the first pass, a pattern
+      // gives one pass per pathname
+      struct ptr_vec values = {0};
+      size_t count = node->has_in ? 0 : (size_t)env->num_positional;
+      for (size_t i = 0; node->has_in && i < node->num_words; i++) {
+        char *value = expand_word(node->words[i], env, &line_arena);
+        if (value == NULL || !expand_field(node->words[i], value, &values, env, &line_arena)) {
+          fprintf(stderr, "Error mallocing for the for loop words!\n");
+          continue;
+        }
+        for (; count < values.len; count++) {
+          if ((values.items[count] = strdup(values.items[count])) == NULL)
+            break;
+        }
+        values.len = count;
+      }
+      env->last_status = 0;
+      interp.loop_depth++;
+      for (size_t i = 0; i < count; i++) {
+        service_events(&events, env, 0);
+        char const *value = node->has_in ? values.items[i] : env->positional[i];
+        if (!var_set(&env->vars, node->name, strlen(node->name), value)) {
+          fprintf(stderr, "Error mallocing for a variable!\n");
+          break;
+        }
+        exec_list(env, node->body);
+        if (loop_done())
+          break;
+      }
+      interp.loop_depth--;
+      for (size_t i = 0; i < values.len; i++)
+        free(values.items[i]);
+      free(values.items);
+      break;
+    }
+
+    case NODE_FUNCTION:
+      define_function(node->name, node->body);
+      env->last_status = 0;
+      break;
+  }
+}
+
+
+struct function *find_function(char const *name) {
+  for (struct function *fn = functions; fn != NULL; fn = fn->next) {
+    if (strcmp(fn->name, name) == 0)
+      return fn;
+  }
+  return NULL;
+}
+
+
+// Copies a program into a, strings included, so it outlives its input line
+struct node *copy_node(struct node const *src, struct arena *a) {
+  struct node *head = NULL;
+  struct node **tail = &head;
+
+  for (; src != NULL; src = src->next) {
+    struct node *node = arena_alloc(a, sizeof *node);
+    if (node == NULL)
+      return NULL;
+    *node = *src;
+    node->next = NULL;
+    if (src->words) {
+      node->words = arena_alloc(a, (src->num_words + 1) * sizeof *node->words);
+      if (node->words == NULL)
+        return NULL;
+      for (size_t i = 0; i < src->num_words; i++)
+        node->words[i] = arena_strdup(a, src->words[i]);
+    }
+    if (src->name)
+      node->name = arena_strdup(a, src->name);
+    node->cond = src->cond ? copy_node(src->cond, a) : NULL;
+    node->body = src->body ? copy_node(src->body, a) : NULL;
+    node->else_body = src->else_body ? copy_node(src->else_body, a) : NULL;
+    *tail = node;
+    tail = &node->next;
+  }
+  return head;
+}
+
+
+static void free_function(struct function *fn) {
+  arena_free(&fn->arena);
+  free(fn);
+}
+
+
+// Defines or replaces a function, a running one is only unlinked
+void define_function(char const *name, struct node *body) {
+
+  struct function *fn = calloc(1, sizeof *fn);
+  if (fn == NULL || (fn->name = arena_strdup(&fn->arena, name)) == NULL ||
+      (fn->body = copy_node(body, &fn->arena)) == NULL) {
+    fprintf(stderr, "Error mallocing for a function!\n");
+    if (fn)
+      free_function(fn);
+    return;
+  }
+
+  for (struct function **link = &functions; *link != NULL; link = &(*link)->next) {
+    struct function *old = *link;
+    if (strcmp(old->name, name) != 0)
+      continue;
+    *link = old->next;
+    if (old->running)
+      old->defunct = true;
+    else
+      free_function(old);
+    break;
+  }
+  fn->next = functions;
+  functions = fn;
+}
+
+
+// Runs a function with the command's arguments as $1 ... $#
+void call_function(struct env_vars *env, struct function *fn, struct parsed_tokens *pt) {
+
+  if (interp.func_depth >= 1000) {
+    fprintf(stderr, "Error, %s: functions nested too deeply.\n", fn->name);
+    update_last_fg_status(env, 1 << 8);
+    return;
+  }
+
+  // The arguments live in the line arena, which the body's commands reset
+  int argc = 0;
+  while (pt->cmd_args[argc] != NULL)
+    argc++;
+  char **args = malloc((argc + 1) * sizeof *args);
+  if (args == NULL) {
+    fprintf(stderr, "Error mallocing for the function arguments!\n");
+    return;
+  }
+  for (int i = 0; i < argc; i++)
+    args[i] = strdup(pt->cmd_args[i]);
+  args[argc] = NULL;
+
+  char **saved_positional = env->positional;
+  int saved_num_positional = env->num_positional;
+  int saved_loop_depth = interp.loop_depth;
+  env->positional = args;
+  env->num_positional = argc;
+  interp.loop_depth = 0; // break and continue do not reach the caller's loops
+  interp.func_depth++;
+  fn->running++;
+
+  env->last_status = 0;
+  exec_list(env, fn->body);
+
+  fn->running--;
+  interp.func_depth--;
+  interp.returning = false;
+  interp.loop_depth = saved_loop_depth;
+  env->positional = saved_positional;
+  env->num_positional = saved_num_positional;
+  for (int i = 0; i < argc; i++)
+    free(args[i]);
+  free(args);
+  if (fn->defunct && fn->running == 0)
+    free_function(fn);
+}
+
+
+// Starts every stage of the pipeline at once, each reading the previous one's pipe.
+// Fills pids with one entry per stage (0 where the launch failed) and returns how
+// many stages started. With job control they share the first stage's process group.
+// Given mux_fds, the last stage's stdout and every stage's stderr go into pipes
+// whose read ends are returned there.
+size_t launch_pipeline(struct parsed_tokens *pt, pid_t *pids, bool foreground, int *mux_fds) {
+
+  size_t started = 0;
+  size_t i = 0;
+  pid_t pgid = 0;
+  int in_fd = -1;
+  int mux_out[2] = {-1, -1};
+  int mux_err[2] = {-1, -1};
+
+  if (mux_fds != NULL) {
+    if (pipe2(mux_out, O_CLOEXEC) < 0 || pipe2(mux_err, O_CLOEXEC) < 0) {
+      perror("Error creating the output pipes");
+      if (mux_out[0] != -1) {
+        close(mux_out[0]);
+        close(mux_out[1]);
+      }
+      mux_out[0] = mux_out[1] = -1;
+    }
+    mux_fds[0] = mux_out[0];
+    mux_fds[1] = mux_err[0];
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &pt->started);
+
+  for (struct parsed_tokens *stage = pt; stage; stage = stage->next_stage, i++) {
+    int pipefd[2] = {-1, -1};
+    if (stage->next_stage) {
+      if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        perror("pipe()");
+        for (; stage; stage = stage->next_stage, i++)
+          pids[i] = 0;
+        break;
+      }
+      if (pipe_size > 0 && fcntl(pipefd[1], F_SETPIPE_SZ, (int)pipe_size) < 0)
+        perror("fcntl(F_SETPIPE_SZ)");
+    }
+
+    // A here-document or here-string takes the place of the pipe from the
+    // previous stage
+    int data_fd = -1;
+    if (stage->input_data && (data_fd = open_input_data(stage->input_data)) == -1)
+      perror("Error creating the here-document");
+
+    int out_fd = stage->next_stage ? pipefd[1] : mux_out[1];
+    uint64_t launch_start = trace_begin();
+    pid_t pid = data_fd == -1 && stage->input_data ? -1 :
+        launch_command(stage, pgid, data_fd != -1 ? data_fd : in_fd, out_fd, mux_err[1], foreground);
+    trace_end(PHASE_LAUNCH, launch_start, stage->cmd);
+    if (data_fd != -1)
+      close(data_fd);
+    if (pid < 0) {
+      if (data_fd != -1 || !stage->input_data)
+        fprintf(stderr, "Error executing %s: %s\n", stage->cmd, strerror(errno));
+      pids[i] = 0;
+    }
+    else {
+      pids[i] = pid;
+      started++;
+      if (pgid == 0)
+        pgid = pid;
+    }
+
+    // The children hold their own copies of the pipe ends now
+    if (in_fd != -1)
+      close(in_fd);
+    if (pipefd[1] != -1)
+      close(pipefd[1]);
+    in_fd = pipefd[0];
+  }
+
+  if (in_fd != -1)
+    close(in_fd);
+  if (mux_out[1] != -1) {
+    close(mux_out[1]);
+    close(mux_err[1]);
+  }
+  return started;
+}
+
+// A readable fd holding data, never a file on disk. Text that fits in a pipe
+// without blocking goes through one, anything longer into a memfd.
+int open_input_data(char const *data) {
+
+  size_t len = strlen(data);
+  int fd;
+  if (len <= PIPE_BUF) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+      return -1;
+    ssize_t wrote = write(fds[1], data, len);
+    close(fds[1]);
+    if (wrote != (ssize_t)len) {
+      close(fds[0]);
+      return -1;
+    }
+    return fds[0];
+  }
+
+  fd = memfd_create("smallsh-heredoc", MFD_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  for (size_t done = 0; done < len;) {
+    ssize_t wrote = write(fd, data + done, len - done);
+    if (wrote == -1) {
+      close(fd);
+      return -1;
+    }
+    done += wrote;
+  }
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+
+// Applies redirections left to right on top of the current fds. With saved,
+// a copy of each fd is kept first for restore_redirections(), -1 when the fd
+// was not open and -2 for the ones never reached.
+int apply_redirections(struct redirection const *redirs, size_t n, int *saved) {
+
+  for (size_t i = 0; saved && i < n; i++)
+    saved[i] = -2;
+  for (size_t i = 0; i < n; i++) {
+    struct redirection const *r = &redirs[i];
+    if (saved) {
+      saved[i] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+      if (saved[i] == -1 && errno != EBADF) {
+        perror("fcntl()");
+        return -1;
+      }
+    }
+
+    if (r->path == NULL) {
+      if (r->source == -1)
+        close(r->fd);
+      else if (r->source != r->fd && dup2(r->source, r->fd) == -1) {
+        perror("dup2()");
+        return -1;
+      }
+      continue;
+    }
+
+    // open() may hand out r->fd itself when it was closed
+    int fd = open(r->path, r->flags | O_CLOEXEC, 0777);
+    if (fd == -1) {
+      perror((r->flags & O_ACCMODE) == O_RDONLY ? "Source open()" : "Output open()");
+      return -1;
+    }
+    if (fd == r->fd)
+      fcntl(fd, F_SETFD, 0);
+    else {
+      int ok = dup2(fd, r->fd);
+      close(fd);
+      if (ok == -1) {
+        perror("dup2()");
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+// Puts back the fds apply_redirections() replaced, last one first
+void restore_redirections(struct redirection const *redirs, size_t n, int *saved) {
+  for (size_t i = n; i-- > 0;) {
+    if (saved[i] == -2)
+      continue;
+    if (saved[i] == -1)
+      close(redirs[i].fd);
+    else {
+      dup2(saved[i], redirs[i].fd);
+      close(saved[i]);
+    }
+    saved[i] = -2;
+  }
+}
+
+
+// Writes the operator of r as it would be typed, "2>>" or "3>&1", returns its length
+int format_redirection(char *buf, struct redirection const *r) {
+  bool input = r->path != NULL && (r->flags & O_ACCMODE) == O_RDONLY;
+  int len = 0;
+  if (r->fd != (input ? STDIN_FILENO : STDOUT_FILENO))
+    len += sprintf(buf, "%d", r->fd);
+  if (r->path == NULL && r->source == -1)
+    len += sprintf(buf + len, ">&-");
+  else if (r->path == NULL)
+    len += sprintf(buf + len, ">&%d", r->source);
+  else
+    len += sprintf(buf + len, "%s", input ? "<" : r->flags & O_APPEND ? ">>" : ">");
+  return len;
+}
+
+
+size_t count_stages(struct parsed_tokens *pt) {
+  size_t count = 0;
+  for (; pt; pt = pt->next_stage)
+    count++;
+  return count;
+}
+
+
+// Starts one command with in_fd/out_fd (-1 for none) as its stdin/stdout, joining
+// process group pgid (0 starts a new one) when the shell does job control
+pid_t launch_command(struct parsed_tokens *pt, pid_t pgid, int in_fd, int out_fd, int err_fd, bool foreground) {
+
+  char const *name = pt->input_for_execvp[0];
+  char const *path = name;
+  pid_t pid = -1;
+
+  // Only a forked child can place itself before the exec
+  bool placed = placement_applies(pt, foreground);
+
+  // Utilities run in a forked copy of the shell, there is nothing to exec
+  struct builtin const *builtin = find_builtin(name);
+  if (builtin != NULL && builtin->utility != NULL && utility_applies(builtin, pt)) {
+    if (launch_engine == LAUNCH_ZYGOTE && !placed &&
+        (pid = launch_zygote(pt, NULL, pgid, in_fd, out_fd, err_fd, foreground)) >= 0)
+      return pid;
+    return launch_fork(pt, NULL, pgid, in_fd, out_fd, err_fd, foreground);
+  }
+
+  // Names with a slash are used as is, everything else goes through the cache
+  if (strchr(name, '/') == NULL) {
+    struct path_cache_entry *entry = path_cache_lookup(&path_cache, name);
+    if (entry == NULL) {
+      errno = ENOENT;
+      return -1;
+    }
+    entry->hits++;
+    path = entry->path;
+  }
+
+  pid_t (*launch)(struct parsed_tokens *, char const *, pid_t, int, int, int, bool) =
+      launch_engine == LAUNCH_ZYGOTE ? launch_zygote : launch_spawn;
+  if (launch_engine != LAUNCH_FORK && !placed) {
+    pid = launch(pt, path, pgid, in_fd, out_fd, err_fd, foreground);
+    // The cached binary went away, resolve it again once
+    if (pid < 0 && errno == ENOENT && path != name) {
+      path_cache_forget(&path_cache, name);
+      struct path_cache_entry *entry = path_cache_lookup(&path_cache, name);
+      if (entry == NULL) {
+        errno = ENOENT;
+        return -1;
+      }
+      entry->hits++;
+      path = entry->path;
+      pid = launch(pt, path, pgid, in_fd, out_fd, err_fd, foreground);
+    }
+    // Only fall back to fork() when the engine itself could not create the child
+    if (pid >= 0 || (errno != ENOSYS && errno != EAGAIN && errno != ENOMEM))
+      return pid;
+  }
+  return launch_fork(pt, path, pgid, in_fd, out_fd, err_fd, foreground);
+}
+
+
+pid_t launch_spawn(struct parsed_tokens *pt, char const *path, pid_t pgid, int in_fd, int out_fd, int err_fd,
+                   bool foreground) {
+
+  posix_spawn_file_actions_t actions;
+  pid_t pid = -1;
+  int err;
+
+  if ((err = posix_spawn_file_actions_init(&actions)) != 0) {
+    errno = err;
+    return -1;
+  }
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+  // The leader of a foreground job takes the terminal before it can read from
+  // it, while fd 0 is still the terminal and not a pipe or a redirected file
+  if (job_control && foreground && pgid == 0)
+    err = posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#endif
+
+  // Pipe ends first, so explicit redirections override them
+  if (err == 0 && in_fd != -1)
+    err = posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+  if (err == 0 && out_fd != -1)
+    err = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+  if (err == 0 && err_fd != -1)
+    err = posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+
+  // Apply the redirections in the same order as the fork() path
+  for (size_t i = 0; err == 0 && i < pt->num_redirs; i++) {
+    struct redirection const *r = &pt->redirs[i];
+    if (r->path)
+      err = posix_spawn_file_actions_addopen(&actions, r->fd, r->path, r->flags, 0777);
+    else if (r->source == -1)
+      err = posix_spawn_file_actions_addclose(&actions, r->fd);
+    else
+      err = posix_spawn_file_actions_adddup2(&actions, r->source, r->fd);
+  }
+
+  // The child must not inherit the shell's blocked SIGCHLD or ignored SIGTTOU
+  posix_spawnattr_t attr;
+  if (err == 0 && (err = posix_spawnattr_init(&attr)) == 0) {
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigmask(&attr, &shell_sigmask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    if (job_control) {
+      posix_spawnattr_setpgroup(&attr, pgid);
+      flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    err = posix_spawn(&pid, path, &actions, &attr, pt->input_for_execvp, var_envp(&env.vars));
+    posix_spawnattr_destroy(&attr);
+  }
+
+  posix_spawn_file_actions_destroy(&actions);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  return pid;
+}
+
+
+// A NULL path runs the utility builtin named by the command in the child
+pid_t launch_fork(struct parsed_tokens *pt, char const *path, pid_t pgid, int in_fd, int out_fd, int err_fd,
+                  bool foreground) {
+
+  // The child must not write out output the shell still has buffered
+  fflush(stdout);
+  struct placement place;
+  bool placed = placement_for(pt, foreground, &place);
+
+  pid_t spawnpid = fork(); // If fork is successful, the value of spawnpid will be 0 in the child, the child's pid in the parent
+  if (spawnpid > 0 && job_control)
+    setpgid(spawnpid, pgid ? pgid : spawnpid); // also done in the child, whichever runs first wins
+  if (spawnpid != 0)
+    return spawnpid;
+
+  // This is the child process
+  if (job_control) {
+    setpgid(0, pgid);
+    if (foreground && pgid == 0)
+      tcsetpgrp(STDIN_FILENO, getpid()); // SIGTTOU is still ignored here
+  }
+  exec_child(pt, path, in_fd, out_fd, err_fd, placed ? &place : NULL);
+}
+
+
+// Sets up the fds of a forked child, places it and execs the command, or runs
+// the utility when path is NULL. Never returns.
+void exec_child(struct parsed_tokens *pt, char const *path, int in_fd, int out_fd, int err_fd,
+                struct placement const *place) {
+
+  signal(SIGTTOU, SIG_DFL);
+  sigprocmask(SIG_SETMASK, &shell_sigmask, NULL);
+
+  // Connect the pipeline, redirections below override these
+  if (in_fd != -1)
+    dup2(in_fd, STDIN_FILENO);
+  if (out_fd != -1)
+    dup2(out_fd, STDOUT_FILENO);
+  if (err_fd != -1)
+    dup2(err_fd, STDERR_FILENO);
+
+  if (apply_redirections(pt->redirs, pt->num_redirs, NULL) == -1)
+    _exit(EXIT_FAILURE);
+  if (place != NULL && apply_placement(place) == -1)
+    _exit(EXIT_FAILURE);
+
+  if (path == NULL) {
+    int status = find_builtin(pt->cmd)->utility(pt);
+    if (fflush(stdout) == EOF)
+      status = 1;
+    _exit(status);
+  }
+
+  char **envp = var_envp(&env.vars);
+  execve(path, pt->input_for_execvp, envp);
+  // A stale cache entry, let execvpe() search PATH the slow way
+  if (errno == ENOENT && strchr(pt->input_for_execvp[0], '/') == NULL)
+    execvpe(pt->input_for_execvp[0], pt->input_for_execvp, envp);
+  perror("Error executing that command.");
+  _exit(EXIT_FAILURE);
+}
+
+
+// The resource limits "@name=value" sets, named as in RLIMIT_*
+static struct {
+  char const *name;
+  int resource;
+} const place_limits[] = {
+  {"as", RLIMIT_AS}, {"core", RLIMIT_CORE}, {"cpu", RLIMIT_CPU}, {"data", RLIMIT_DATA},
+  {"fsize", RLIMIT_FSIZE}, {"memlock", RLIMIT_MEMLOCK}, {"nofile", RLIMIT_NOFILE},
+  {"nproc", RLIMIT_NPROC}, {"stack", RLIMIT_STACK},
+};
+
+static char const *const place_policies[] = {
+  [SCHED_OTHER] = "other", [SCHED_BATCH] = "batch", [SCHED_IDLE] = "idle",
+};
+
+
+// Reads "@name=value" into place: cpus (a list like 0-3,8), nice, sched
+// (other, batch or idle), cgroup or a resource limit (a count with an
+// optional K, M or G, or "unlimited"). The cgroup points into word.
+int parse_placement(char const *word, struct placement *place) {
+
+  char const *value = strchr(word, '=') + 1;
+  size_t name_len = value - word - 2;
+  char const *name = word + 1;
+  char *end;
+
+  if (name_len == 4 && strncmp(name, "cpus", 4) == 0) {
+    CPU_ZERO(&place->cpus);
+    char const *p = value;
+    do {
+      unsigned long first = strtoul(p, &end, 10);
+      unsigned long last = first;
+      if (end != p && *end == '-') {
+        p = end + 1;
+        last = strtoul(p, &end, 10);
+      }
+      if (end == p || first > last || last >= CPU_SETSIZE || (*end != ',' && *end != '\0'))
+        goto invalid;
+      for (unsigned long cpu = first; cpu <= last; cpu++)
+        CPU_SET(cpu, &place->cpus);
+      p = end + 1;
+    } while (*end == ',');
+    place->set |= PLACE_CPUS;
+    return 0;
+  }
+  if (name_len == 4 && strncmp(name, "nice", 4) == 0) {
+    long nice = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || nice < -20 || nice > 19)
+      goto invalid;
+    place->nice = nice;
+    place->set |= PLACE_NICE;
+    return 0;
+  }
+  if (name_len == 5 && strncmp(name, "sched", 5) == 0) {
+    for (size_t i = 0; i < sizeof place_policies / sizeof place_policies[0]; i++) {
+      if (place_policies[i] && strcmp(value, place_policies[i]) == 0) {
+        place->policy = i;
+        place->set |= PLACE_SCHED;
+        return 0;
+      }
+    }
+    goto invalid;
+  }
+  if (name_len == 6 && strncmp(name, "cgroup", 6) == 0) {
+    if (*value == '\0')
+      goto invalid;
+    place->cgroup = (char *)value;
+    place->set |= PLACE_CGROUP;
+    return 0;
+  }
+  for (size_t i = 0; i < sizeof place_limits / sizeof place_limits[0]; i++) {
+    if (strlen(place_limits[i].name) != name_len || strncmp(name, place_limits[i].name, name_len) != 0)
+      continue;
+    rlim_t limit = RLIM_INFINITY;
+    if (strcmp(value, "unlimited") != 0) {
+      unsigned long long n = strtoull(value, &end, 10);
+      int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+      if (end == value || !isdigit((unsigned char)*value) || end[shift > 0] != '\0' || n > (RLIM_INFINITY - 1) >> shift)
+        goto invalid;
+      limit = (rlim_t)n << shift;
+    }
+    int resource = place_limits[i].resource;
+    place->limits[resource].rlim_cur = limit;
+    place->limits[resource].rlim_max = limit;
+    place->limits_set |= 1u << resource;
+    return 0;
+  }
+  fprintf(stderr, "Error, %.*s: unknown placement.\n", (int)(value - word - 1), word);
+  return -1;
+
+invalid:
+  fprintf(stderr, "Error, %s: invalid value.\n", word);
+  return -1;
+}
+
+
+bool placement_applies(struct parsed_tokens const *pt, bool foreground) {
+  struct placement const *defaults = &job_placement[!foreground];
+  return pt->placement != NULL || defaults->set != 0 || defaults->limits_set != 0;
+}
+
+
+// The "place" defaults for the job with the command's own settings on top.
+// Returns false when there is nothing to apply.
+bool placement_for(struct parsed_tokens const *pt, bool foreground, struct placement *place) {
+
+  *place = job_placement[!foreground];
+  struct placement const *own = pt->placement;
+  if (own != NULL) {
+    if (own->set & PLACE_CPUS)
+      place->cpus = own->cpus;
+    if (own->set & PLACE_NICE)
+      place->nice = own->nice;
+    if (own->set & PLACE_SCHED)
+      place->policy = own->policy;
+    if (own->set & PLACE_CGROUP)
+      place->cgroup = own->cgroup;
+    for (int r = 0; r < RLIMIT_NLIMITS; r++) {
+      if (own->limits_set & 1u << r)
+        place->limits[r] = own->limits[r];
+    }
+    place->set |= own->set;
+    place->limits_set |= own->limits_set;
+  }
+  return place->set != 0 || place->limits_set != 0;
+}
+
+
+// Moves the calling child into its cgroup first, joining a cpuset there
+// resets the affinity, then sets the rest. Returns -1 with the error printed.
+int apply_placement(struct placement const *place) {
+
+  // cgroup v2 is mounted on /sys/fs/cgroup, or below it in systemd's hybrid layout
+  if (place->set & PLACE_CGROUP) {
+    static char const *const roots[] = {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"};
+    char const *cgroup = place->cgroup + (place->cgroup[0] == '/');
+    int err = ENOENT; // the cgroup is in neither, unless one said otherwise
+    for (size_t i = 0; cgroup != NULL && i < sizeof roots / sizeof roots[0]; i++) {
+      char procs[PATH_MAX];
+      int fd = -1;
+      if (snprintf(procs, sizeof procs, "%s/%s/cgroup.procs", roots[i], cgroup) >= (int)sizeof procs)
+        errno = ENAMETOOLONG;
+      else if ((fd = open(procs, O_WRONLY | O_CLOEXEC)) != -1 && write(fd, "0", 1) == 1)
+        cgroup = NULL;
+      if (cgroup != NULL && errno != ENOENT && err == ENOENT)
+        err = errno;
+      if (fd != -1)
+        close(fd);
+    }
+    if (cgroup != NULL) {
+      fprintf(stderr, "Error, @cgroup=%s: %s\n", place->cgroup, strerror(err));
+      return -1;
+    }
+  }
+  if ((place->set & PLACE_CPUS) && sched_setaffinity(0, sizeof place->cpus, &place->cpus) == -1) {
+    perror("Error, @cpus");
+    return -1;
+  }
+  struct sched_param param = {0};
+  if ((place->set & PLACE_SCHED) && sched_setscheduler(0, place->policy, &param) == -1) {
+    perror("Error, @sched");
+    return -1;
+  }
+  if ((place->set & PLACE_NICE) && setpriority(PRIO_PROCESS, 0, place->nice) == -1) {
+    perror("Error, @nice");
+    return -1;
+  }
+  for (size_t i = 0; i < sizeof place_limits / sizeof place_limits[0]; i++) {
+    int resource = place_limits[i].resource;
+    if ((place->limits_set & 1u << resource) && setrlimit(resource, &place->limits[resource]) == -1) {
+      fprintf(stderr, "Error, @%s: %s\n", place_limits[i].name, strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+// Prints the settings as the "@name=value" words that make them
+void print_placement(FILE *out, struct placement const *place) {
+
+  if (place->set & PLACE_CPUS) {
+    fprintf(out, " @cpus=");
+    char const *sep = "";
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &place->cpus))
+        continue;
+      int last = cpu;
+      while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &place->cpus))
+        last++;
+      fprintf(out, last > cpu ? "%s%d-%d" : "%s%d", sep, cpu, last);
+      sep = ",";
+      cpu = last;
+    }
+  }
+  if (place->set & PLACE_NICE)
+    fprintf(out, " @nice=%d", place->nice);
+  if (place->set & PLACE_SCHED)
+    fprintf(out, " @sched=%s", place_policies[place->policy]);
+  if (place->set & PLACE_CGROUP)
+    fprintf(out, " @cgroup=%s", place->cgroup);
+  for (size_t i = 0; i < sizeof place_limits / sizeof place_limits[0]; i++) {
+    struct rlimit const *limit = &place->limits[place_limits[i].resource];
+    if (!(place->limits_set & 1u << place_limits[i].resource))
+      continue;
+    if (limit->rlim_cur == RLIM_INFINITY)
+      fprintf(out, " @%s=unlimited", place_limits[i].name);
+    else
+      fprintf(out, " @%s=%llu", place_limits[i].name, (unsigned long long)limit->rlim_cur);
+  }
+}
+
+
+// Forks the zygote and keeps our end of the socketpair, call it before the
+// shell allocates anything the zygote would otherwise carry along
+int start_zygote(struct zygote *z, bool interactive) {
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    return -1;
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    close(sv[0]);
+    zygote_main(sv[1], interactive);
+  }
+  close(sv[1]);
+  z->pid = pid;
+  z->sock = sv[0];
+  return 0;
+}
+
+
+// Stops using the zygote, launches fall back to posix_spawn() and fork()
+static void zygote_lost(void) {
+  fprintf(stderr, "smallsh: zygote gone, launching directly\n");
+  close(zygote.sock);
+  zygote.sock = -1;
+  launch_engine = LAUNCH_SPAWN;
+}
+
+
+// Sends one launch request to the zygote and waits for the exec to go through.
+// A NULL path runs the utility builtin named by the command.
+pid_t launch_zygote(struct parsed_tokens *pt, char const *path, pid_t pgid, int in_fd, int out_fd, int err_fd,
+                    bool foreground) {
+
+  if (zygote.sock == -1) {
+    errno = ENOSYS;
+    return -1;
+  }
+  char *cwd = getcwd(NULL, 0);
+  if (cwd == NULL)
+    return -1;
+
+  // Lay out the header and the strings back to back
+  struct zygote_request req = {pgid, foreground, 0, -1, pt->num_redirs};
+  size_t size = sizeof req + strlen(path ? path : "") + strlen(cwd) + 2;
+  for (; pt->input_for_execvp[req.argc] != NULL; req.argc++)
+    size += strlen(pt->input_for_execvp[req.argc]) + 1;
+  for (size_t i = 0; i < pt->num_redirs; i++)
+    size += 3 * sizeof(int32_t) + strlen(pt->redirs[i].path ? pt->redirs[i].path : "") + 1;
+
+  // The environment only goes along when it changed since the last request
+  char **envp = var_envp(&env.vars);
+  if (zygote.env_generation != env.vars.generation) {
+    for (req.envc = 0; envp[req.envc] != NULL; req.envc++)
+      size += strlen(envp[req.envc]) + 1;
+  }
+
+  // A command line too long for one message goes the direct way
+  char *buf = size <= ZYGOTE_MAX_REQUEST ? malloc(size) : NULL;
+  if (buf == NULL) {
+    free(cwd);
+    errno = ENOSYS;
+    return -1;
+  }
+  memcpy(buf, &req, sizeof req);
+  char *p = stpcpy(buf + sizeof req, path ? path : "") + 1;
+  for (uint32_t i = 0; i < req.argc; i++)
+    p = stpcpy(p, pt->input_for_execvp[i]) + 1;
+  p = stpcpy(p, cwd) + 1;
+  // Each redirection is its fd, flags and source, then the path or ""
+  for (size_t i = 0; i < pt->num_redirs; i++) {
+    struct redirection const *r = &pt->redirs[i];
+    int32_t fields[3] = {r->fd, r->flags, r->source};
+    memcpy(p, fields, sizeof fields);
+    p = stpcpy(p + sizeof fields, r->path ? r->path : "") + 1;
+  }
+  for (int32_t i = 0; i < req.envc; i++)
+    p = stpcpy(p, envp[i]) + 1;
+  free(cwd);
+
+  int fds[3] = {in_fd != -1 ? in_fd : STDIN_FILENO, out_fd != -1 ? out_fd : STDOUT_FILENO,
+                err_fd != -1 ? err_fd : STDERR_FILENO};
+  union {
+    struct cmsghdr align;
+    char data[CMSG_SPACE(sizeof fds)];
+  } control;
+  struct iovec iov = {buf, size};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data;
+  msg.msg_controllen = sizeof control.data;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+  ssize_t sent;
+  while ((sent = sendmsg(zygote.sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+    ;
+  free(buf);
+
+  struct zygote_reply reply;
+  ssize_t got = -1;
+  if (sent >= 0) {
+    while ((got = recv(zygote.sock, &reply, sizeof reply, 0)) < 0 && errno == EINTR)
+      ;
+  }
+  if (got != sizeof reply) {
+    zygote_lost();
+    errno = ENOSYS;
+    return -1;
+  }
+
+  // A child whose exec failed has already exited, reap it before the event loop sees it
+  if (reply.error != 0) {
+    if (reply.pid > 0)
+      waitpid(reply.pid, NULL, 0);
+    errno = reply.error;
+    return -1;
+  }
+  if (req.envc >= 0)
+    zygote.env_generation = env.vars.generation;
+  return reply.pid;
+}
+
+
+// Child side of a zygote launch, the same setup as launch_fork() then exec. For
+// an exec it shares the zygote's memory (CLONE_VM), the zygote being suspended
+// until the exec, and must not touch anything but the launch it was given.
+static int zygote_child(void *arg) {
+
+  struct zygote_launch *launch = arg;
+  struct zygote_request const *req = &launch->req;
+
+  if (job_control) {
+    setpgid(0, req->pgid);
+    if (req->foreground && req->pgid == 0)
+      tcsetpgrp(STDIN_FILENO, getpid()); // SIGTTOU is still ignored here
+  }
+  signal(SIGTTOU, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTSTP, SIG_DFL);
+
+  // The fds arrived above 2, so none of these overwrite each other
+  for (int i = 0; i < 3; i++)
+    dup2(launch->fds[i], i);
+
+  char **argv = launch->argv;
+  if (apply_redirections(launch->redirs, req->num_redirs, NULL) == -1)
+    _exit(EXIT_FAILURE);
+
+  if (*launch->path == '\0') {
+    struct parsed_tokens utility;
+    init_parsed_tokens_struct(&utility);
+    utility.cmd = argv[0];
+    utility.cmd_args = argv + 1;
+    utility.input_for_execvp = argv;
+    int status = find_builtin(argv[0])->utility(&utility);
+    if (fflush(stdout) == EOF)
+      status = 1;
+    _exit(status);
+  }
+
+  execve(launch->path, argv, launch->envp);
+  launch->error = errno;
+  _exit(127);
+}
+
+
+// Steps *p over the string it points at, false when no NUL ends it before end
+static bool zygote_skip_string(char **p, char const *end) {
+  char *nul = *p < end ? memchr(*p, '\0', end - *p) : NULL;
+  if (nul == NULL)
+    return false;
+  *p = nul + 1;
+  return true;
+}
+
+
+// Request loop of the zygote, it exits when the shell closes its end
+void zygote_main(int sock, bool interactive) {
+
+  // Ctrl-C and Ctrl-Z at the prompt reach our process group too
+  signal(SIGINT, SIG_IGN);
+  signal(SIGTSTP, SIG_IGN);
+  job_control = interactive;
+  if (job_control)
+    signal(SIGTTOU, SIG_IGN);
+
+  char *buf = malloc(ZYGOTE_MAX_REQUEST);
+  char *stack = malloc(ZYGOTE_STACK_SIZE);
+  char **argv = NULL;
+  size_t argv_cap = 0;
+  struct redirection *redirs = NULL;
+  size_t redirs_cap = 0;
+  char *cwd = NULL;
+  char **envp = environ; // replaced by the first request that carries one
+  char *env_buf = NULL;
+  if (buf == NULL || stack == NULL)
+    _exit(EXIT_FAILURE);
+
+  while (true) {
+    union {
+      struct cmsghdr align;
+      char data[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct iovec iov = {buf, ZYGOTE_MAX_REQUEST};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof control.data;
+
+    ssize_t got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      _exit(0);
+
+    int fds[3] = {-1, -1, -1};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof fds))
+      memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+
+    // Walk the strings, a request with one cut short is rejected
+    struct zygote_request req;
+    struct zygote_reply reply = {-1, EINVAL};
+    char *p = buf + sizeof req;
+    char *end = buf + got;
+    memcpy(&req, buf, sizeof req);
+    if ((size_t)got <= sizeof req || req.argc > ZYGOTE_MAX_REQUEST / 2)
+      goto reply;
+    if (argv_cap < req.argc + 1) {
+      argv_cap = req.argc + 1;
+      argv = realloc(argv, argv_cap * sizeof *argv);
+      if (argv == NULL)
+        _exit(EXIT_FAILURE);
+    }
+    char const *path = p;
+    for (uint32_t i = 0; i < req.argc; i++) {
+      if (!zygote_skip_string(&p, end))
+        goto reply;
+      argv[i] = p;
+    }
+    argv[req.argc] = NULL;
+    if (!zygote_skip_string(&p, end))
+      goto reply;
+    char const *dir = p;
+    if (!zygote_skip_string(&p, end))
+      goto reply;
+
+    if (fds[2] == -1 || req.argc == 0 || req.envc > ZYGOTE_MAX_REQUEST / 2 ||
+        req.num_redirs > ZYGOTE_MAX_REQUEST / 16)
+      goto reply;
+    if (redirs_cap < req.num_redirs) {
+      redirs_cap = req.num_redirs;
+      redirs = realloc(redirs, redirs_cap * sizeof *redirs);
+      if (redirs == NULL)
+        _exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < req.num_redirs; i++) {
+      int32_t fields[3];
+      if (p + sizeof fields >= end)
+        goto reply;
+      memcpy(fields, p, sizeof fields);
+      p += sizeof fields;
+      redirs[i].fd = fields[0];
+      redirs[i].flags = fields[1];
+      redirs[i].source = fields[2];
+      redirs[i].path = *p ? p : NULL;
+      if (!zygote_skip_string(&p, end))
+        goto reply;
+    }
+
+    // Keep a copy of a new environment, buf is overwritten by the next request
+    if (req.envc >= 0) {
+      char *first = p; // the environment strings follow the redirections
+      char *last = first;
+      for (int32_t i = 0; i < req.envc; i++) {
+        if (!zygote_skip_string(&last, end))
+          goto reply;
+      }
+      char **new_envp = malloc((req.envc + 1) * sizeof *new_envp);
+      char *new_buf = malloc(last - first + 1);
+      if (new_envp == NULL || new_buf == NULL)
+        _exit(EXIT_FAILURE);
+      memcpy(new_buf, first, last - first);
+      char *q = new_buf;
+      for (int32_t i = 0; i < req.envc; i++) {
+        new_envp[i] = q;
+        q += strlen(q) + 1;
+      }
+      new_envp[req.envc] = NULL;
+      if (envp != environ)
+        free(envp);
+      free(env_buf);
+      envp = new_envp;
+      env_buf = new_buf;
+    }
+
+    // Children inherit the cwd, it only changes after a cd in the shell
+    if (cwd == NULL || strcmp(cwd, dir) != 0) {
+      if (chdir(dir) < 0) {
+        reply.error = errno;
+        goto reply;
+      }
+      free(cwd);
+      cwd = strdup(dir);
+    }
+
+    // An exec runs vfork() style, clone() returns once it went through or
+    // failed. Utility builtins get a copy of the zygote to run in.
+    struct zygote_launch launch = {req, path, argv, redirs, envp, {fds[0], fds[1], fds[2]}, 0};
+    int flags = CLONE_PARENT | SIGCHLD;
+    if (*path != '\0')
+      flags |= CLONE_VM | CLONE_VFORK;
+    pid_t pid = clone(zygote_child, stack + ZYGOTE_STACK_SIZE, flags, &launch);
+    reply.pid = pid;
+    reply.error = pid < 0 ? errno : launch.error;
+
+reply:
+    for (int i = 0; i < 3; i++) {
+      if (fds[i] != -1)
+        close(fds[i]);
+    }
+    if (send(sock, &reply, sizeof reply, MSG_NOSIGNAL) < 0)
+      _exit(EXIT_FAILURE);
+  }
+}
+
+
+void execute_cd_command(struct env_vars *env, struct parsed_tokens *pt) {
+
+  if (pt->cmd_args[0] == NULL) {
+    char const *home = var_get(&env->vars, "HOME");
+    if (chdir(home ? home : "") != 0) {
+      perror("Error, unable to CD to the home directory!");
+    }
+  }
+  else {
+    if (chdir(pt->cmd_args[0]) < 0) {
+      perror("Error, unable to CD to that directory!\n");
+    }
+  }
+}
+
+
+void execute_hash_command(struct env_vars *env, struct parsed_tokens *pt) {
+
+  // "hash -r" empties the cache
+  if (pt->cmd_args[0] != NULL && strcmp(pt->cmd_args[0], "-r") == 0) {
+    path_cache_clear(&path_cache);
+    return;
+  }
+
+  // "hash name..." resolves the names into the cache without running them
+  if (pt->cmd_args[0] != NULL) {
+    for (int i = 0; pt->cmd_args[i] != NULL; i++) {
+      if (strchr(pt->cmd_args[i], '/') != NULL)
+        continue;
+      if (path_cache_lookup(&path_cache, pt->cmd_args[i]) == NULL)
+        fprintf(stderr, "hash: %s: not found\n", pt->cmd_args[i]);
+    }
+    return;
+  }
+
+  // Plain "hash" lists the cache
+  if (path_cache.count == 0) {
+    fprintf(stderr, "hash: hash table empty\n");
+    return;
+  }
+  printf("hits\tcommand\n");
+  for (size_t i = 0; i < path_cache.capacity; i++) {
+    if (path_cache.slots[i].name)
+      printf("%4u\t%s\n", path_cache.slots[i].hits, path_cache.slots[i].path);
+  }
+  fflush(stdout);
+}
+
+
+void execute_jobs_command(struct env_vars *env, struct parsed_tokens *pt) {
+  for (size_t i = 0; i < job_table.id_cap; i++) {
+    struct job *job = job_table.by_id[i];
+    if (job == NULL)
+      continue;
+    printf("[%d]%c %-8s %7jd  %s\n", job->id, job->id == job_table.current_id ? '+' : ' ',
+           job->state == JOB_QUEUED ? "Queued" : "Running", (intmax_t)job->pgid, job->command);
+  }
+  fflush(stdout);
+}
+
+
+void execute_wait_command(struct env_vars *env, struct parsed_tokens *pt) {
+
+  // Plain "wait" blocks until every job, queued ones included, has finished
+  if (pt->cmd_args[0] == NULL) {
+    while (job_table.count > 0) {
+      if (service_events(&events, env, -1) < 0)
+        return;
+    }
+    mux_drain(&events);
+    update_last_fg_status(env, 0);
+    return;
+  }
+
+  // "wait %n|pid..." sets $? to the status of the last one
+  int status = 0;
+  for (int i = 0; pt->cmd_args[i] != NULL; i++) {
+    struct job *job = job_from_spec(&job_table, pt->cmd_args[i]);
+    if (job == NULL) {
+      fprintf(stderr, "wait: %s: no such job\n", pt->cmd_args[i]);
+      status = 127 << 8;
+      continue;
+    }
+    job_table.wait_id = job->id;
+    job_table.wait_done = false;
+    while (!job_table.wait_done) {
+      if (service_events(&events, env, -1) < 0) {
+        job_table.wait_id = 0;
+        return;
+      }
+    }
+    job_table.wait_id = 0;
+    status = job_table.wait_status;
+  }
+  mux_drain(&events);
+  update_last_fg_status(env, status);
+}
+
+
+void execute_fg_command(struct env_vars *env, struct parsed_tokens *pt) {
+
+  char const *spec = pt->cmd_args[0];
+  struct job *job = spec ? job_from_spec(&job_table, spec) : job_by_id(&job_table, job_table.current_id);
+  if (job == NULL) {
+    fprintf(stderr, "fg: %s: no such job\n", spec ? spec : "current");
+    update_last_fg_status(env, 1 << 8);
+    return;
+  }
+  fprintf(stderr, "%s\n", job->command);
+
+  // A queued job skips the line and starts right away
+  if (job->state == JOB_QUEUED) {
+    job_dequeue(&job_table, job);
+    if (!job_launch(&job_table, &events, env, job, true)) {
+      update_last_fg_status(env, 1 << 8);
+      return;
+    }
+  }
+  else {
+    signal_job(job, SIGCONT);
+  }
+
+  // The wait zeroes reaped stages, so it gets its own copy of the pids
+  size_t count = job->num_pids;
+  pid_t *pids = arena_alloc(&line_arena, count * sizeof *pids);
+  memcpy(pids, job->pids, count * sizeof *pids);
+  int status = job->status;
+  if (wait_foreground(&events, env, pids, count, job->pgid, NULL, &status))
+    update_last_fg_status(env, status);
+}
+
+
+void execute_bg_command(struct env_vars *env, struct parsed_tokens *pt) {
+
+  char const *spec = pt->cmd_args[0];
+  struct job *job = spec ? job_from_spec(&job_table, spec) : job_by_id(&job_table, job_table.current_id);
+  if (job == NULL) {
+    fprintf(stderr, "bg: %s: no such job\n", spec ? spec : "current");
+    return;
+  }
+
+  // Queued jobs start now, past the limit, running ones are sent SIGCONT
+  if (job->state == JOB_QUEUED) {
+    job_dequeue(&job_table, job);
+    if (!job_launch(&job_table, &events, env, job, false))
+      return;
+  }
+  else {
+    signal_job(job, SIGCONT);
+  }
+  fprintf(stderr, "[%d] %s &\n", job->id, job->command);
+}
+
+
+// qsort() comparison for arrays of strings
+static int compare_strings(void const *a, void const *b) {
+  return strcmp(*(char const *const *)a, *(char const *const *)b);
+}
+
+
+void execute_set_command(struct env_vars *env, struct parsed_tokens *pt) {
+
+  // "set -j N" caps the number of background jobs running at once, 0 lifts the cap
+  if (pt->cmd_args[0] != NULL && strcmp(pt->cmd_args[0], "-j") == 0) {
+    if (pt->cmd_args[1] == NULL) {
+      printf("%zu\n", job_table.limit);
+      fflush(stdout);
+      return;
+    }
+    char *end;
+    long limit = strtol(pt->cmd_args[1], &end, 10);
+    if (*end != '\0' || limit < 0) {
+      fprintf(stderr, "set: -j: %s: not a job count\n", pt->cmd_args[1]);
+      update_last_fg_status(env, 2 << 8);
+      return;
+    }
+    job_table.limit = limit;
+    schedule_jobs(&job_table, &events, env);
+    return;
+  }
+
+  // "set -o" lists the options, "set -o name=value" changes one
+  if (pt->cmd_args[0] != NULL && strcmp(pt->cmd_args[0], "-o") == 0) {
+    char const *option = pt->cmd_args[1];
+    if (option == NULL) {
+      printf("jobs=%zu\n", job_table.limit);
+      printf("pipesize=%zu\n", pipe_size);
+      printf("acct=%s\n", acct_path ? acct_path : "");
+      printf("builtins=%d\n", builtin_utilities);
+      printf("mux=%d\n", mux_output);
+      printf("profile=%d\n", profiling);
+      fflush(stdout);
+      return;
+    }
+    if (strncmp(option, "pipesize=", 9) == 0) {
+      char *end;
+      long size = strtol(option + 9, &end, 10);
+      if (*end == '\0' && end != option + 9 && size >= 0) {
+        pipe_size = size;
+        return;
+      }
+    }
+    else if (strncmp(option, "acct=", 5) == 0) {
+      // An empty path turns accounting off
+      if (acct_fd != -1)
+        close(acct_fd);
+      free(acct_path);
+      acct_fd = -1;
+      acct_path = NULL;
+      if (option[5] == '\0')
+        return;
+      acct_fd = open(option + 5, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+      if (acct_fd != -1) {
+        acct_path = strdup(option + 5);
+        return;
+      }
+      fprintf(stderr, "set: -o: %s: %s\n", option + 5, strerror(errno));
+      update_last_fg_status(env, 1 << 8);
+      return;
+    }
+    else if (strcmp(option, "builtins=0") == 0 || strcmp(option, "builtins=1") == 0) {
+      builtin_utilities = option[9] == '1';
+      return;
+    }
+    else if (strcmp(option, "mux=0") == 0 || strcmp(option, "mux=1") == 0) {
+      mux_output = option[4] == '1';
+      return;
+    }
+    else if (strcmp(option, "profile=0") == 0 || strcmp(option, "profile=1") == 0) {
+      profiling = option[8] == '1';
+      return;
+    }
+    else if (strncmp(option, "jobs=", 5) == 0) {
+      char *end;
+      long limit = strtol(option + 5, &end, 10);
+      if (*end == '\0' && end != option + 5 && limit >= 0) {
+        job_table.limit = limit;
+        schedule_jobs(&job_table, &events, env);
+        return;
+      }
+    }
+    fprintf(stderr, "set: -o: %s: invalid option\n", option);
+    update_last_fg_status(env, 2 << 8);
+    return;
+  }
+
+  // Plain "set" lists every variable, sorted by name
+  if (pt->cmd_args[0] == NULL) {
+    char const **entries = malloc(env->vars.count * sizeof *entries);
+    size_t n = 0;
+    for (size_t i = 0; entries && i < env->vars.capacity; i++) {
+      if (env->vars.slots[i].entry)
+        entries[n++] = env->vars.slots[i].entry;
+    }
+    qsort(entries, n, sizeof *entries, compare_strings);
+    for (size_t i = 0; i < n; i++)
+      puts(entries[i]);
+    fflush(stdout);
+    free(entries);
+    return;
+  }
+
+  fprintf(stderr, "set: usage: set [-j [N] | -o [name=value]]\n");
+  update_last_fg_status(env, 2 << 8);
+}
+
+
+// "place" lists the defaults, "place fg|bg [@name=value]..." replaces those
+// of foreground or background jobs, no settings clear them
+void execute_place_command(struct env_vars *env, struct parsed_tokens *pt) {
+
+  static char const *const kinds[] = {"fg", "bg"};
+  char **args = pt->cmd_args;
+  if (args[0] == NULL) {
+    for (int i = 0; i < 2; i++) {
+      printf("place %s", kinds[i]);
+      print_placement(stdout, &job_placement[i]);
+      putchar('\n');
+    }
+    fflush(stdout);
+    return;
+  }
+
+  int kind = strcmp(args[0], "fg") == 0 ? 0 : strcmp(args[0], "bg") == 0 ? 1 : -1;
+  if (kind == -1) {
+    fprintf(stderr, "place: usage: place [fg|bg [@name=value]...]\n");
+    update_last_fg_status(env, 2 << 8);
+    return;
+  }
+  struct placement place = {0};
+  for (int i = 1; args[i] != NULL; i++) {
+    if (args[i][0] != '@' || strchr(args[i], '=') == NULL) {
+      fprintf(stderr, "place: %s: not a @name=value setting\n", args[i]);
+      update_last_fg_status(env, 2 << 8);
+      return;
+    }
+    if (parse_placement(args[i], &place) < 0) {
+      update_last_fg_status(env, 2 << 8);
+      return;
+    }
+  }
+  if (place.cgroup != NULL && (place.cgroup = strdup(place.cgroup)) == NULL) {
+    perror("place");
+    update_last_fg_status(env, 1 << 8);
+    return;
+  }
+  free(job_placement[kind].cgroup);
+  job_placement[kind] = place;
+}
+
+
+// "export" lists the exported variables, "export NAME[=value]..." exports them
+void execute_export_command(struct env_vars *env, struct parsed_tokens *pt) {
+
+  if (pt->cmd_args[0] == NULL) {
+    char const **entries = malloc(env->vars.count * sizeof *entries);
+    size_t n = 0;
+    for (size_t i = 0; entries && i < env->vars.capacity; i++) {
+      if (env->vars.slots[i].entry && env->vars.slots[i].exported)
+        entries[n++] = env->vars.slots[i].entry;
+    }
+    qsort(entries, n, sizeof *entries, compare_strings);
+    for (size_t i = 0; i < n; i++)
+      printf("export %s\n", entries[i]);
+    fflush(stdout);
+    free(entries);
+    return;
+  }
+
+  for (int i = 0; pt->cmd_args[i] != NULL; i++) {
+    char const *arg = pt->cmd_args[i];
+    size_t len = var_name_length(arg);
+    if (len == 0 || (arg[len] != '\0' && arg[len] != '=')) {
+      fprintf(stderr, "export: %s: not a valid identifier\n", arg);
+      update_last_fg_status(env, 1 << 8);
+      continue;
+    }
+    // A bare name that is not set yet is exported empty
+    struct var *v = var_lookup(&env->vars, arg, len);
+    if (arg[len] == '=' || v == NULL) {
+      if (!var_set(&env->vars, arg, len, arg[len] == '=' ? arg + len + 1 : "")) {
+        fprintf(stderr, "Error mallocing for a variable!\n");
+        continue;
+      }
+      v = var_lookup(&env->vars, arg, len);
+    }
+    var_export(&env->vars, v);
+  }
+}
+
+
+void execute_unset_command(struct env_vars *env, struct parsed_tokens *pt) {
+  for (int i = 0; pt->cmd_args[i] != NULL; i++) {
+    if (var_name_length(pt->cmd_args[i]) != strlen(pt->cmd_args[i])) {
+      fprintf(stderr, "unset: %s: not a valid identifier\n", pt->cmd_args[i]);
+      update_last_fg_status(env, 1 << 8);
+      continue;
+    }
+    var_unset(&env->vars, pt->cmd_args[i]);
+  }
+}
+
+
+// A line of NAME=value words, running a command with them as its
+// environment is not supported
+void execute_assignments(struct env_vars *env, struct parsed_tokens *pt) {
+
+  for (int i = 0; pt->input_for_execvp[i] != NULL; i++) {
+    char const *word = pt->input_for_execvp[i];
+    size_t len = var_name_length(word);
+    if (len == 0 || word[len] != '=') {
+      fprintf(stderr, "Error, %s: a command after variable assignments is not supported.\n", word);
+      update_last_fg_status(env, 2 << 8);
+      return;
+    }
+  }
+  for (int i = 0; pt->input_for_execvp[i] != NULL; i++) {
+    char const *word = pt->input_for_execvp[i];
+    size_t len = var_name_length(word);
+    if (!var_set(&env->vars, word, len, word + len + 1)) {
+      fprintf(stderr, "Error mallocing for a variable!\n");
+      update_last_fg_status(env, 1 << 8);
+      return;
+    }
+  }
+  update_last_fg_status(env, 0);
+}
+
+// "break [n]" and "continue [n]" leave n enclosing loops, clamped to the ones there are
+static int loop_count_arg(struct env_vars *env, struct parsed_tokens *pt) {
+  if (interp.loop_depth == 0) {
+    fprintf(stderr, "%s: only meaningful in a loop\n", pt->cmd);
+    update_last_fg_status(env, 1 << 8);
+    return 0;
+  }
+  long n = 1;
+  if (pt->cmd_args[0] != NULL) {
+    char *end;
+    n = strtol(pt->cmd_args[0], &end, 10);
+    if (*end != '\0' || n < 1) {
+      fprintf(stderr, "%s: %s: loop count out of range\n", pt->cmd, pt->cmd_args[0]);
+      update_last_fg_status(env, 1 << 8);
+      return interp.loop_depth; // like bash, a bad count leaves every loop
+    }
+  }
+  update_last_fg_status(env, 0);
+  return n < interp.loop_depth ? n : interp.loop_depth;
+}
+
+
+void execute_break_command(struct env_vars *env, struct parsed_tokens *pt) {
+  interp.breaking = loop_count_arg(env, pt);
+}
+
+
+void execute_continue_command(struct env_vars *env, struct parsed_tokens *pt) {
+  interp.continuing = loop_count_arg(env, pt);
+}
+
+
+// "return [n]" leaves the function, with $? as its status unless n is given
+void execute_return_command(struct env_vars *env, struct parsed_tokens *pt) {
+  if (interp.func_depth == 0) {
+    fprintf(stderr, "return: can only be used in a function\n");
+    update_last_fg_status(env, 1 << 8);
+    return;
+  }
+  if (pt->cmd_args[0] != NULL) {
+    char *end;
+    long n = strtol(pt->cmd_args[0], &end, 10);
+    if (*end != '\0' || end == pt->cmd_args[0]) {
+      fprintf(stderr, "return: %s: numeric argument required\n", pt->cmd_args[0]);
+      n = 2;
+    }
+    env->last_status = n & 0xff;
+  }
+  interp.returning = true;
+}
+
+// "read [-r] [name...]" reads a line of stdin and splits it on IFS into the
+// names, the last one takes the rest of the line. Without -r a backslash
+// quotes the next character and joins a line ending in it to the next.
+void execute_read_command(struct env_vars *env, struct parsed_tokens *pt) {
+
+  bool raw = false;
+  int first = 0;
+  for (; pt->cmd_args[first] != NULL && pt->cmd_args[first][0] == '-'; first++) {
+    if (strcmp(pt->cmd_args[first], "-r") != 0) {
+      fprintf(stderr, "read: %s: invalid option\n", pt->cmd_args[first]);
+      update_last_fg_status(env, 2 << 8);
+      return;
+    }
+    raw = true;
+  }
+  char *reply[] = {"REPLY", NULL};
+  char **names = pt->cmd_args[first] ? pt->cmd_args + first : reply;
+  size_t count = 0;
+  for (; names[count] != NULL; count++) {
+    if (var_name_length(names[count]) != strlen(names[count])) {
+      fprintf(stderr, "read: %s: not a valid identifier\n", names[count]);
+      update_last_fg_status(env, 2 << 8);
+      return;
+    }
+  }
+
+  // "read < file" reads the first line of the file, "read <<< word" the word.
+  // A redirected stdin is read through a copy so it never looks like the
+  // shell's own input to read_line().
+  int fd = STDIN_FILENO;
+  struct read_buffer file_buffer = {0};
+  struct read_buffer *rb = &stdin_buffer;
+  int saved[pt->num_redirs + 1];
+  bool redirected = false;
+  for (size_t i = 0; i < pt->num_redirs; i++)
+    redirected |= pt->redirs[i].fd == STDIN_FILENO;
+  if (apply_redirections(pt->redirs, pt->num_redirs, saved) == -1) {
+    restore_redirections(pt->redirs, pt->num_redirs, saved);
+    update_last_fg_status(env, 1 << 8);
+    return;
+  }
+  if (redirected || pt->input_data) {
+    fd = redirected ? fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0) : open_input_data(pt->input_data);
+    restore_redirections(pt->redirs, pt->num_redirs, saved);
+    if (fd == -1) {
+      perror(redirected ? "read" : "Error creating the here-document");
+      update_last_fg_status(env, 1 << 8);
+      return;
+    }
+    rb = &file_buffer;
+  }
+
+  // Collect the line, and the ones a trailing backslash continues it with
+  char empty[1] = "";
+  char *text = empty;
+  size_t text_len = 0;
+  int status = 1;
+  while (true) {
+    char *line;
+    ssize_t len = read_line(rb, fd, &line);
+    if (len == -1) {
+      if (errno == EINTR) {
+        fprintf(stderr, "\n");
+        interp.interrupted = true;
+        status = 130;
+      }
+      break;
+    }
+    bool complete = len > 0 && line[len - 1] == '\n';
+    if (complete)
+      len--;
+    size_t backslashes = 0;
+    while (!raw && backslashes < (size_t)len && line[len - 1 - backslashes] == '\\')
+      backslashes++;
+    bool joined = complete && backslashes % 2 == 1;
+    if (joined)
+      len--;
+
+    char *joined_text = arena_alloc(&line_arena, text_len + len + 1);
+    if (joined_text == NULL) {
+      fprintf(stderr, "Error mallocing for the read line!\n");
+      break;
+    }
+    memcpy(joined_text, text, text_len);
+    memcpy(joined_text + text_len, line, len);
+    text = joined_text;
+    text_len += len;
+    text[text_len] = '\0';
+    if (!joined) {
+      status = complete ? 0 : 1;
+      break;
+    }
+  }
+  if (rb == &file_buffer) {
+    close(fd);
+    free(file_buffer.buf);
+  }
+  restore_redirections(pt->redirs, pt->num_redirs, saved);
+
+  // Quoted characters never split, the scan for delimiters is scalar then
+  bool *quoted = NULL;
+  if (!raw && text_len > 0 && memchr(text, '\\', text_len) != NULL) {
+    quoted = arena_alloc(&line_arena, text_len);
+    if (quoted == NULL) {
+      fprintf(stderr, "Error mallocing for the read line!\n");
+      update_last_fg_status(env, 1 << 8);
+      return;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < text_len; i++) {
+      quoted[n] = text[i] == '\\';
+      if (quoted[n] && ++i == text_len)
+        break;
+      text[n++] = text[i];
+    }
+    text_len = n;
+    text[text_len] = '\0';
+  }
+
+  char const *ifs = var_get(&env->vars, "IFS");
+  struct delim_set ds;
+  init_delim_set(&ds, ifs ? ifs : " \t\n");
+
+  size_t i = 0;
+  for (size_t k = 0; k < count; k++) {
+    while (i < text_len && ds.member[(unsigned char)text[i]] && !(quoted && quoted[i]))
+      i++;
+    size_t start = i;
+    size_t end = text_len;
+    if (k + 1 == count) {
+      while (end > start && ds.member[(unsigned char)text[end - 1]] && !(quoted && quoted[end - 1]))
+        end--;
+    }
+    else if (quoted == NULL) {
+      char *delim = scan_delims(text + start, text_len - start, &ds);
+      if (delim)
+        end = delim - text;
+    }
+    else {
+      for (end = start; end < text_len; end++) {
+        if (ds.member[(unsigned char)text[end]] && !quoted[end])
+          break;
+      }
+    }
+    i = end < text_len ? end + 1 : text_len;
+    text[end] = '\0';
+    if (!var_set(&env->vars, names[k], strlen(names[k]), text + start)) {
+      fprintf(stderr, "Error mallocing for a variable!\n");
+      status = 1;
+      break;
+    }
+  }
+  update_last_fg_status(env, status << 8);
+}
+
+
+// Reads the next line from fd, '\n' included unless the input ended first.
+// *line points into rb until the next call. Returns -1 at the end of input.
+ssize_t read_line(struct read_buffer *rb, int fd, char **line) {
+
+  // Commands read from stdin with getline(), stdio already holds what follows
+  if (fd == STDIN_FILENO && lexer.in != NULL && lexer.in->kind == INPUT_STDIN) {
+    ssize_t len = getline(&rb->buf, &rb->cap, stdin);
+    if (len == -1)
+      clearerr(stdin);
+    rb->valid = false;
+    *line = rb->buf;
+    return len;
+  }
+
+  // The buffer only holds while nobody else moved the file offset
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (!rb->valid || offset != rb->start + (off_t)rb->pos) {
+    struct stat sb;
+    rb->regular = offset != -1 && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode);
+    rb->start = offset;
+    rb->pos = rb->len = 0;
+    rb->valid = true;
+  }
+
+  // Pipes and terminals are read a byte at a time, children share them
+  if (!rb->regular) {
+    size_t len = 0;
+    while (true) {
+      if (len == rb->cap) {
+        size_t cap = rb->cap ? rb->cap * 2 : 128;
+        char *buf = realloc(rb->buf, cap);
+        if (buf == NULL)
+          return -1;
+        rb->buf = buf;
+        rb->cap = cap;
+      }
+      ssize_t got = read(fd, rb->buf + len, 1);
+      if (got == -1)
+        return -1;
+      if (got == 0 || rb->buf[len++] == '\n')
+        break;
+    }
+    if (rb->start != -1)
+      rb->start += len;
+    *line = rb->buf;
+    if (len == 0)
+      errno = 0;
+    return len ? (ssize_t)len : -1;
+  }
+
+  struct delim_set newline;
+  init_delim_set(&newline, "\n");
+  size_t scanned = rb->pos;
+  size_t end;
+  while (true) {
+    char *found = scan_delims(rb->buf + scanned, rb->len - scanned, &newline);
+    if (found) {
+      end = found - rb->buf + 1;
+      break;
+    }
+
+    // Keep the partial line at the front and read the next block after it
+    if (rb->pos > 0) {
+      memmove(rb->buf, rb->buf + rb->pos, rb->len - rb->pos);
+      rb->start += rb->pos;
+      rb->len -= rb->pos;
+      rb->pos = 0;
+    }
+    scanned = rb->len;
+    if (rb->len == rb->cap) {
+      size_t cap = rb->cap ? rb->cap * 2 : READ_BUFFER_SIZE;
+      char *buf = realloc(rb->buf, cap);
+      if (buf == NULL)
+        return -1;
+      rb->buf = buf;
+      rb->cap = cap;
+    }
+    ssize_t got = pread(fd, rb->buf + rb->len, rb->cap - rb->len, rb->start + rb->len);
+    if (got == -1)
+      return -1;
+    if (got == 0) {
+      end = rb->len;
+      break;
+    }
+    rb->len += got;
+  }
+
+  *line = rb->buf + rb->pos;
+  size_t len = end - rb->pos;
+  rb->pos = end;
+  if (len == 0) {
+    errno = 0;
+    return -1;
+  }
+  lseek(fd, rb->start + rb->pos, SEEK_SET);
+  return len;
+}
+
+
+void init_delim_set(struct delim_set *ds, char const *chars) {
+  memset(ds->member, 0, sizeof ds->member);
+  int n = 0;
+  for (; *chars; chars++) {
+    if (ds->member[(unsigned char)*chars])
+      continue;
+    ds->member[(unsigned char)*chars] = true;
+    if (n < 4)
+      ds->bytes[n] = *chars;
+    n++;
+  }
+  ds->count = n <= 4 ? n : 0;
+}
+
+
+// First byte of p[0..len) in the set or NULL. Whole vectors are compared
+// against each delimiter at once, the tail and big sets go through the table.
+char *scan_delims(char *p, size_t len, struct delim_set const *ds) {
+
+#if defined(__AVX2__)
+  if (ds->count > 0) {
+    __m256i delims[4];
+    for (int i = 0; i < ds->count; i++)
+      delims[i] = _mm256_set1_epi8(ds->bytes[i]);
+    for (; len >= 32; p += 32, len -= 32) {
+      __m256i chunk = _mm256_loadu_si256((__m256i const *)p);
+      __m256i hit = _mm256_cmpeq_epi8(chunk, delims[0]);
+      for (int i = 1; i < ds->count; i++)
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(chunk, delims[i]));
+      unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+      if (mask)
+        return p + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__SSE2__)
+  if (ds->count > 0) {
+    __m128i delims[4];
+    for (int i = 0; i < ds->count; i++)
+      delims[i] = _mm_set1_epi8(ds->bytes[i]);
+    for (; len >= 16; p += 16, len -= 16) {
+      __m128i chunk = _mm_loadu_si128((__m128i const *)p);
+      __m128i hit = _mm_cmpeq_epi8(chunk, delims[0]);
+      for (int i = 1; i < ds->count; i++)
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(chunk, delims[i]));
+      unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+      if (mask)
+        return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  for (; len > 0; p++, len--) {
+    if (ds->member[(unsigned char)*p])
+      return p;
+  }
+  return NULL;
+}
+
+
+void execute_exit_command(struct env_vars *env, struct parsed_tokens *pt) {
+
+  // A command substitution only ends its own process
+  if (in_subshell) {
+    fflush(stdout);
+    _exit(pt->cmd_args[0] ? atoi(pt->cmd_args[0]) : env->last_status);
+  }
+ 
+  // What finished jobs wrote is still shown
+  mux_drain(&events);
+
+  // Jobs in their own process groups do not get the group SIGINT below, and
+  // a script shell only signals its own jobs
+  for (size_t i = 0; i < job_table.id_cap; i++) {
+    if (job_table.by_id[i])
+      signal_job(job_table.by_id[i], SIGINT);
+  }
+
+  if (pt->cmd_args[0] != NULL) { // an argument was provided
+
+    // if the argument is not an integer, it is an error, or if more than 1 arguments are supplied, it is an error
+    if (pt->cmd_args[1] != NULL) {
+      perror("Error, too many arguments for exit command provided");
+      exit(2);
+    }
+    if (isdigit(*pt->cmd_args[0]) == 0) {
+      perror("Error, argument for exit command is not an integer");
+      exit(2);
+    }
+
+    int tmp = atoi(pt->cmd_args[0]);
+    env->last_status = tmp;
+  }
+
+  // An interactive shell owns its process group, send SIGINT through kill() to
+  // all child processes. A script shell shares the group of whoever ran it.
+  if (job_control) {
+    signal(SIGINT, SIG_IGN);
+    if (kill(0, SIGINT) < 0) {
+      perror("Error with kill()");
+      exit(2);
+    }
+    fprintf(stderr, "\nexit\n");
+  }
+  exit(env->last_status);
+};
+
+
+// Shell builtins are always found, utilities unless "set -o builtins=0"
+struct builtin const *find_builtin(char const *name) {
+  for (size_t i = 0; i < sizeof builtins / sizeof builtins[0]; i++) {
+    if (strcmp(builtins[i].name, name) == 0)
+      return builtins[i].shell || builtin_utilities ? &builtins[i] : NULL;
+  }
+  return NULL;
+}
+
+
+// Whether the utility covers this use of the command, cat only does plain
+// concatenation of files
+bool utility_applies(struct builtin const *builtin, struct parsed_tokens const *pt) {
+  if (builtin->utility != builtin_cat)
+    return true;
+  if (pt->cmd_args[0] == NULL)
+    return false;
+  for (char **arg = pt->cmd_args; *arg != NULL; arg++) {
+    if ((*arg)[0] == '-')
+      return false;
+  }
+  return true;
+}
+
+
+// Runs a utility in the shell process, redirections are applied by swapping the
+// standard fds and putting them back, in the same order as the fork() path
+int run_utility(struct builtin const *builtin, struct parsed_tokens *pt) {
+
+  int saved[pt->num_redirs + 1];
+  int status = 1;
+
+  fflush(stdout);
+  if (apply_redirections(pt->redirs, pt->num_redirs, saved) == -1)
+    goto restore;
+
+  status = builtin->utility(pt);
+  if (fflush(stdout) == EOF) {
+    perror(pt->cmd);
+    clearerr(stdout);
+    status = 1;
+  }
+
+restore:
+  restore_redirections(pt->redirs, pt->num_redirs, saved);
+  return status;
+}
+
+
+int builtin_echo(struct parsed_tokens *pt) {
+  char **args = pt->cmd_args;
+  bool newline = true;
+  if (args[0] != NULL && strcmp(args[0], "-n") == 0) {
+    newline = false;
+    args++;
+  }
+  for (int i = 0; args[i] != NULL; i++) {
+    if (i > 0)
+      putchar(' ');
+    fputs(args[i], stdout);
+  }
+  if (newline)
+    putchar('\n');
+  return 0;
+}
+
+
+int builtin_true(struct parsed_tokens *pt) {
+  return 0;
+}
+
+
+int builtin_false(struct parsed_tokens *pt) {
+  return 1;
+}
+
+
+// Prints the backslash escape starting at p, returns its last character
+static char const *print_escape(char const *p) {
+  static char const from[] = "abfnrtv\\";
+  static char const to[] = "\a\b\f\n\r\t\v\\";
+
+  char const *c = p[1] ? strchr(from, p[1]) : NULL;
+  if (c != NULL) {
+    putchar(to[c - from]);
+    return p + 1;
+  }
+  // \NNN, up to three octal digits
+  if (p[1] >= '0' && p[1] <= '7') {
+    int value = 0;
+    int i = 1;
+    for (; i <= 3 && p[i] >= '0' && p[i] <= '7'; i++)
+      value = value * 8 + (p[i] - '0');
+    putchar(value);
+    return p + i - 1;
+  }
+  putchar('\\');
+  return p;
+}
+
+
+// printf format [arguments], the format is reused until the arguments run out
+int builtin_printf(struct parsed_tokens *pt) {
+
+  if (pt->cmd_args[0] == NULL) {
+    fprintf(stderr, "printf: usage: printf format [arguments]\n");
+    return 2;
+  }
+  char const *format = pt->cmd_args[0];
+  char **args = pt->cmd_args + 1;
+  int status = 0;
+
+  char **before;
+  do {
+    before = args;
+    for (char const *p = format; *p; p++) {
+      if (*p == '\\') {
+        p = print_escape(p);
+        continue;
+      }
+      if (*p != '%') {
+        putchar(*p);
+        continue;
+      }
+      if (p[1] == '%') {
+        putchar('%');
+        p++;
+        continue;
+      }
+
+      // Copy flags, width and precision, room is left for the "ll" length modifier
+      char spec[32] = "%";
+      size_t len = 1;
+      p++;
+      while (*p && strchr("-+ #0123456789.", *p) && len < sizeof spec - 4)
+        spec[len++] = *p++;
+
+      char const *arg = *args ? *args++ : NULL;
+      char *end;
+      switch (*p) {
+      case 's':
+        spec[len] = 's';
+        printf(spec, arg ? arg : "");
+        break;
+      case 'c':
+        spec[len] = 'c';
+        printf(spec, arg ? arg[0] : '\0');
+        break;
+      case 'd':
+      case 'i': {
+        long long value = arg ? strtoll(arg, &end, 0) : 0;
+        if (arg && (*end != '\0' || end == arg)) {
+          fprintf(stderr, "printf: %s: invalid number\n", arg);
+          status = 1;
+        }
+        memcpy(spec + len, "ll", 2);
+        spec[len + 2] = *p;
+        printf(spec, value);
+        break;
+      }
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X': {
+        unsigned long long value = arg ? strtoull(arg, &end, 0) : 0;
+        if (arg && (*end != '\0' || end == arg)) {
+          fprintf(stderr, "printf: %s: invalid number\n", arg);
+          status = 1;
+        }
+        memcpy(spec + len, "ll", 2);
+        spec[len + 2] = *p;
+        printf(spec, value);
+        break;
+      }
+      case 'f':
+      case 'e':
+      case 'g': {
+        double value = arg ? strtod(arg, &end) : 0;
+        if (arg && (*end != '\0' || end == arg)) {
+          fprintf(stderr, "printf: %s: invalid number\n", arg);
+          status = 1;
+        }
+        spec[len] = *p;
+        printf(spec, value);
+        break;
+      }
+      default:
+        fprintf(stderr, "printf: %%%c: invalid conversion\n", *p ? *p : ' ');
+        return 1;
+      }
+    }
+  } while (args != before && *args != NULL);
+
+  return status;
+}
+
+
+// Returns 0 if the unary test holds, 1 if not and 2 for an unknown operator
+static int test_unary(char const *op, char const *operand) {
+  struct stat st;
+
+  if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+    fprintf(stderr, "test: %s: unary operator expected\n", op);
+    return 2;
+  }
+  switch (op[1]) {
+  case 'n': return operand[0] == '\0';
+  case 'z': return operand[0] != '\0';
+  case 'e': return stat(operand, &st) != 0;
+  case 'f': return stat(operand, &st) != 0 || !S_ISREG(st.st_mode);
+  case 'd': return stat(operand, &st) != 0 || !S_ISDIR(st.st_mode);
+  case 's': return stat(operand, &st) != 0 || st.st_size == 0;
+  case 'h':
+  case 'L': return lstat(operand, &st) != 0 || !S_ISLNK(st.st_mode);
+  case 'r': return access(operand, R_OK) != 0;
+  case 'w': return access(operand, W_OK) != 0;
+  case 'x': return access(operand, X_OK) != 0;
+  }
+  fprintf(stderr, "test: %s: unary operator expected\n", op);
+  return 2;
+}
+
+
+static bool test_integer(char const *str, long long *value) {
+  char *end;
+  errno = 0;
+  *value = strtoll(str, &end, 10);
+  if (*end != '\0' || end == str || errno != 0) {
+    fprintf(stderr, "test: %s: integer expression expected\n", str);
+    return false;
+  }
+  return true;
+}
+
+
+// Returns 0 or 1 like test_unary(), -1 if op is not a binary operator
+static int test_binary(char const *left, char const *op, char const *right) {
+
+  if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+    return strcmp(left, right) != 0;
+  if (strcmp(op, "!=") == 0)
+    return strcmp(left, right) == 0;
+
+  static char const *const ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+  size_t i = 0;
+  while (i < 6 && strcmp(op, ops[i]) != 0)
+    i++;
+  if (i == 6)
+    return -1;
+
+  long long a, b;
+  if (!test_integer(left, &a) || !test_integer(right, &b))
+    return 2;
+  bool result[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+  return !result[i];
+}
+
+
+// POSIX picks the meaning of a test expression by its number of arguments
+static int test_eval(char **args, int argc) {
+  int status;
+
+  switch (argc) {
+  case 0:
+    return 1;
+  case 1:
+    return args[0][0] == '\0';
+  case 2:
+    if (strcmp(args[0], "!") == 0)
+      return (status = test_eval(args + 1, 1)) == 2 ? 2 : !status;
+    return test_unary(args[0], args[1]);
+  case 3:
+    if ((status = test_binary(args[0], args[1], args[2])) >= 0)
+      return status;
+    if (strcmp(args[0], "!") == 0)
+      return (status = test_eval(args + 1, 2)) == 2 ? 2 : !status;
+    if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0)
+      return test_eval(args + 1, 1);
+    fprintf(stderr, "test: %s: binary operator expected\n", args[1]);
+    return 2;
+  case 4:
+    if (strcmp(args[0], "!") == 0)
+      return (status = test_eval(args + 1, 3)) == 2 ? 2 : !status;
+    break;
+  }
+  fprintf(stderr, "test: too many arguments\n");
+  return 2;
+}
+
+
+// test expr and [ expr ]
+int builtin_test(struct parsed_tokens *pt) {
+  int argc = 0;
+  while (pt->cmd_args[argc] != NULL)
+    argc++;
+
+  if (strcmp(pt->cmd, "[") == 0) {
+    if (argc == 0 || strcmp(pt->cmd_args[argc - 1], "]") != 0) {
+      fprintf(stderr, "[: missing ]\n");
+      return 2;
+    }
+    argc--;
+  }
+  return test_eval(pt->cmd_args, argc);
+}
+
+
+int builtin_pwd(struct parsed_tokens *pt) {
+  char *cwd = getcwd(NULL, 0);
+  if (cwd == NULL) {
+    perror("pwd");
+    return 1;
+  }
+  puts(cwd);
+  free(cwd);
+  return 0;
+}
+
+
+// Errors after which copy_fd() moves on to a more general way of copying
+static bool copy_unsupported(int err) {
+  return err == EINVAL || err == EXDEV || err == ENOSYS || err == EBADF || err == EOPNOTSUPP || err == ESPIPE;
+}
+
+
+// Copies in to out from the current offsets until the end of in. The data only
+// passes through user space when the kernel cannot move it by itself:
+// copy_file_range() shares or copies extents between regular files,
+// sendfile() feeds any out from the page cache, splice() moves pipe buffers.
+int copy_fd(int in, int out) {
+
+  enum { chunk = 1 << 30 };
+  struct stat sb;
+  ssize_t n = -1;
+  bool regular = fstat(in, &sb) == 0 && S_ISREG(sb.st_mode);
+
+  // Files that report no size (/proc) only read right through read()
+  if (regular && sb.st_size > 0) {
+    while ((n = copy_file_range(in, NULL, out, NULL, chunk, 0)) > 0)
+      ;
+    if (n == 0 || !copy_unsupported(errno))
+      return n;
+    while ((n = sendfile(out, in, NULL, chunk)) > 0)
+      ;
+    if (n == 0 || !copy_unsupported(errno))
+      return n;
+  }
+
+  while ((n = splice(in, NULL, out, NULL, chunk, SPLICE_F_MOVE)) > 0)
+    ;
+  if (n == 0 || !copy_unsupported(errno))
+    return n;
+
+  static char buf[128 * 1024];
+  while ((n = read(in, buf, sizeof buf)) > 0) {
+    for (ssize_t done = 0; done < n;) {
+      ssize_t wrote = write(out, buf + done, n - done);
+      if (wrote == -1)
+        return -1;
+      done += wrote;
+    }
+  }
+  return n;
+}
+
+
+// cat file..., only plain concatenation of named files runs here, anything
+// with options or reading stdin goes to the real cat
+int builtin_cat(struct parsed_tokens *pt) {
+  int status = 0;
+  struct stat out;
+  bool out_regular = fstat(STDOUT_FILENO, &out) == 0 && S_ISREG(out.st_mode);
+  fflush(stdout);
+  for (char **arg = pt->cmd_args; *arg != NULL; arg++) {
+    int fd = open(*arg, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      fprintf(stderr, "cat: %s: %s\n", *arg, strerror(errno));
+      status = 1;
+      continue;
+    }
+    // "cat file >> file" would never reach the end
+    struct stat sb;
+    if (out_regular && fstat(fd, &sb) == 0 && sb.st_dev == out.st_dev && sb.st_ino == out.st_ino) {
+      fprintf(stderr, "cat: %s: input file is output file\n", *arg);
+      status = 1;
+    }
+    else if (copy_fd(fd, STDOUT_FILENO) == -1) {
+      fprintf(stderr, "cat: %s: %s\n", *arg, strerror(errno));
+      status = 1;
+    }
+    close(fd);
+  }
+  return status;
+}
+
+
+// Separator tokens of the lexer, told apart from words by address
+static char token_semi[] = ";";
+static char token_newline[] = "\n";
+static char token_heredoc[] = "<<";
+
+
+static bool lex_read_heredocs(struct lexer *lx);
+
+
+// Pushes a word, "<<EOF", "<< EOF" and the "<<-" forms become "<<" and a
+// placeholder for the body
+static bool lex_push_word(struct lexer *lx, char *word) {
+
+  bool delimiter = lx->heredoc_next;
+  bool strip_tabs = lx->strip_tabs;
+  lx->heredoc_next = false;
+  if (!delimiter && word[0] == '<' && word[1] == '<' && word[2] != '<') {
+    strip_tabs = word[2] == '-';
+    word += 2 + strip_tabs;
+    if (!ptr_vec_push(&lx->tokens, token_heredoc))
+      return false;
+    if (*word == '\0') {
+      lx->heredoc_next = true;
+      lx->strip_tabs = strip_tabs;
+      return true;
+    }
+    delimiter = true;
+  }
+  if (delimiter) {
+    if (lx->num_heredocs == lx->heredocs_cap) {
+      size_t cap = lx->heredocs_cap ? lx->heredocs_cap * 2 : 4;
+      struct heredoc *heredocs = realloc(lx->heredocs, cap * sizeof *heredocs);
+      if (heredocs == NULL)
+        return false;
+      lx->heredocs = heredocs;
+      lx->heredocs_cap = cap;
+    }
+    lx->heredocs[lx->num_heredocs].index = lx->tokens.len;
+    lx->heredocs[lx->num_heredocs++].strip_tabs = strip_tabs;
+  }
+  return ptr_vec_push(&lx->tokens, word);
+}
+
+
+// Nesting of "$(" in p[0..end) after starting at depth, parentheses inside a
+// substitution nest too
+static int subst_depth(char const *p, char const *end, int depth) {
+  for (; p < end; p++) {
+    if (p[0] == '$' && p + 1 < end && p[1] == '(') {
+      depth++;
+      p++;
+    }
+    else if (depth > 0 && *p == '(') {
+      depth++;
+    }
+    else if (depth > 0 && *p == ')') {
+      depth--;
+    }
+  }
+  return depth;
+}
+
+
+// First ';' of word outside a command substitution
+static char *find_separator(char *word) {
+  int depth = 0;
+  for (char *p = word; *p; p++) {
+    if (*p == ';' && depth == 0)
+      return p;
+    depth = subst_depth(p, p + 1 + (p[0] == '$' && p[1] == '('), depth);
+    if (p[0] == '$' && p[1] == '(')
+      p++;
+  }
+  return NULL;
+}
+
+
+// Splits a line into the lexer's tokens. ';' separates commands anywhere in a
+// word, a "#" word comments out the rest of the line.
+static bool lex_load(struct lexer *lx, char *line, size_t len) {
+
+  char const *ifs = var_get(&env.vars, "IFS");
+  size_t num_words = tokenize(line, len, ifs ? ifs : " \t\n", &line_tokens);
+
+  lx->line = line;
+  lx->tokens.len = 0;
+  lx->pos = 0;
+  lx->num_heredocs = 0;
+  lx->heredoc_next = false;
+  for (size_t i = 0; i < num_words; i++) {
+    char *word = line + line_tokens.items[i].offset;
+    char *end = word + line_tokens.items[i].length;
+    if (end - word == 1 && *word == '#')
+      break;
+
+    // A command substitution is one word, blanks and all, up to its ')'
+    int depth = subst_depth(word, end, 0);
+    while (depth > 0 && i + 1 < num_words) {
+      i++;
+      char *next = line + line_tokens.items[i].offset;
+      end = next + line_tokens.items[i].length;
+      depth = subst_depth(next, end, depth);
+    }
+    *end = '\0';
+    for (char *semi; (semi = find_separator(word)) != NULL; word = semi + 1) {
+      *semi = '\0';
+      if ((semi > word && !lex_push_word(lx, word)) || !ptr_vec_push(&lx->tokens, token_semi))
+        return false;
+    }
+    if (*word && !lex_push_word(lx, word))
+      return false;
+  }
+  return ptr_vec_push(&lx->tokens, token_newline) && lex_read_heredocs(lx);
+}
+
+
+// Reads another line of input with the PS2 prompt, -1 at the end of input
+// or on Ctrl-C
+static ssize_t lex_read_line(struct lexer *lx, char **line) {
+
+  struct input_source *in = lx->in;
+
+  // The program still points into the current line, keep getline() from reusing it
+  if (lx->line != NULL && lx->line == in->line) {
+    if (!ptr_vec_push(&lx->retired, in->line))
+      return -1;
+    in->line = NULL;
+    in->n = 0;
+  }
+
+  if (in->interactive) {
+    char const *ps2 = var_get(&env.vars, "PS2");
+    show_prompt(ps2 ? ps2 : ">");
+  }
+  ssize_t len = -1;
+  if ((in->interactive && !editor.enabled && wait_for_input(&events, &env) < 0) ||
+      (len = read_input_line(in, line)) == -1) {
+    if (errno == EINTR) {
+      clearerr(stdin);
+      fprintf(stderr, "\n");
+      lx->interrupted = true;
+    }
+    else if (!in->eof) {
+      perror("getline()");
+    }
+  }
+  return len;
+}
+
+
+// Reads the bodies of the line's here-documents from the lines after it. The
+// delimiter is compared with quotes removed, the body is not copied again.
+static bool lex_read_heredocs(struct lexer *lx) {
+
+  for (size_t h = 0; h < lx->num_heredocs && !lx->interrupted; h++) {
+    char *delim = lx->tokens.items[lx->heredocs[h].index];
+    char *d = delim;
+    for (char const *p = delim; *p; p++) {
+      if (*p != '\'' && *p != '"' && *p != '\\')
+        *d++ = *p;
+    }
+    *d = '\0';
+    size_t delim_len = d - delim;
+
+    // Reading the lines retires more buffers, the body keeps its own slot
+    char *body = malloc(1);
+    size_t body_len = 0;
+    size_t slot = lx->retired.len;
+    if (body == NULL || !ptr_vec_push(&lx->retired, body)) {
+      free(body);
+      return false;
+    }
+    while (true) {
+      char *line;
+      ssize_t len = lex_read_line(lx, &line);
+      if (len == -1) {
+        if (lx->in->eof)
+          fprintf(stderr, "Error, here-document ended by end of file (wanted \"%s\").\n", delim);
+        break;
+      }
+      if (lx->heredocs[h].strip_tabs) {
+        while (len > 0 && *line == '\t') {
+          line++;
+          len--;
+        }
+      }
+      size_t text_len = len > 0 && line[len - 1] == '\n' ? len - 1 : len;
+      if (text_len == delim_len && memcmp(line, delim, delim_len) == 0)
+        break;
+
+      char *grown = realloc(body, body_len + len + 1);
+      if (grown == NULL)
+        return false;
+      lx->retired.items[slot] = body = grown;
+      memcpy(body + body_len, line, len);
+      body_len += len;
+    }
+    body[body_len] = '\0';
+    lx->tokens.items[lx->heredocs[h].index] = body;
+  }
+  return true;
+}
+
+
+// Reads the next line of a command that is still open
+static bool lex_refill(struct lexer *lx) {
+
+  char *line;
+  ssize_t len = lex_read_line(lx, &line);
+  if (len == -1) {
+    if (lx->in->eof)
+      fprintf(stderr, "Error, unexpected end of file.\n");
+    return false;
+  }
+  if (!lex_load(lx, line, len)) {
+    fprintf(stderr, "Error growing the token vector!\n");
+    return false;
+  }
+  return true;
+}
+
+
+// Next token without consuming it, NULL when the input ran out
+static char *lex_peek(struct lexer *lx) {
+  if (lx->pos == lx->tokens.len && !lex_refill(lx))
+    return NULL;
+  return lx->tokens.items[lx->pos];
+}
+
+
+static char *lex_next(struct lexer *lx) {
+  char *token = lex_peek(lx);
+  if (token)
+    lx->pos++;
+  return token;
+}
+
+
+static bool is_word(char const *token, char const *word) {
+  return token != NULL && token != token_semi && token != token_newline && strcmp(token, word) == 0;
+}
+
+
+static bool is_one_of(char const *token, char const *const *words) {
+  for (; words && *words; words++) {
+    if (is_word(token, *words))
+      return true;
+  }
+  return false;
+}
+
+
+// A NULL token means the input ran out, lex_refill() already said why
+static void syntax_error(char const *token) {
+  if (token != NULL)
+    fprintf(stderr, "Error, syntax error near \"%s\".\n", token == token_newline ? "newline" : token);
+}
+
+
+static bool expect(struct lexer *lx, char const *word) {
+  char *token = lex_next(lx);
+  if (is_word(token, word))
+    return true;
+  syntax_error(token);
+  return false;
+}
+
+
+// Skips newlines where a command may continue on the next line, returns the
+// token after them or NULL when the input ran out
+static char *skip_newlines(struct lexer *lx) {
+  char *token;
+  while ((token = lex_peek(lx)) == token_newline)
+    lx->pos++;
+  return token;
+}
+
+
+static struct node *new_node(enum node_kind kind, struct arena *a) {
+  struct node *node = arena_alloc(a, sizeof *node);
+  if (node) {
+    memset(node, 0, sizeof *node);
+    node->kind = kind;
+  }
+  return node;
+}
+
+
+static struct node *parse_and_or(struct lexer *lx, struct arena *a);
+
+
+// Words that close a construct, they end the list in front of them
+static char const *const then_words[] = {"then", NULL};
+static char const *const if_body_words[] = {"elif", "else", "fi", NULL};
+static char const *const fi_words[] = {"fi", NULL};
+static char const *const do_words[] = {"do", NULL};
+static char const *const done_words[] = {"done", NULL};
+static char const *const brace_words[] = {"}", NULL};
+static char const *const reserved_words[] = {"then", "elif", "else", "fi", "do", "done", "}", "&&", "||", NULL};
+
+
+// Parses commands up to one of the terminators without consuming it. At the
+// top level (terminators NULL) the end of the line ends the list, inside a
+// construct more lines are read until the terminator shows up.
+static struct node *parse_list(struct lexer *lx, struct arena *a, char const *const *terminators, bool *ok) {
+
+  struct node *head = NULL;
+  struct node **tail = &head;
+  *ok = false;
+
+  while (true) {
+    char *token = lex_peek(lx);
+    if (token == NULL) {
+      if (terminators == NULL && lx->in->eof && !lx->interrupted)
+        break;
+      syntax_error(NULL);
+      return NULL;
+    }
+    if (token == token_newline) {
+      lx->pos++;
+      if (terminators == NULL)
+        break;
+      continue;
+    }
+    if (token == token_semi) {
+      if (head == NULL) {
+        syntax_error(token);
+        return NULL;
+      }
+      lx->pos++;
+      continue;
+    }
+    if (is_one_of(token, terminators))
+      break;
+
+    struct node *node = parse_and_or(lx, a);
+    if (node == NULL)
+      return NULL;
+    *tail = node;
+    tail = &node->next;
+  }
+  *ok = true;
+  return head;
+}
+
+
+// A list that must not be empty, followed by its closing word
+static struct node *parse_block(struct lexer *lx, struct arena *a, char const *const *terminators) {
+  bool ok;
+  struct node *list = parse_list(lx, a, terminators, &ok);
+  if (ok && list == NULL) {
+    syntax_error(lex_peek(lx));
+    return NULL;
+  }
+  return list;
+}
+
+
+// "if" or "elif" was consumed, an elif chain nests and ends at the one "fi"
+static struct node *parse_if(struct lexer *lx, struct arena *a) {
+
+  struct node *node = new_node(NODE_IF, a);
+  if (node == NULL || (node->cond = parse_block(lx, a, then_words)) == NULL || !expect(lx, "then"))
+    return NULL;
+  if ((node->body = parse_block(lx, a, if_body_words)) == NULL)
+    return NULL;
+
+  char *token = lex_next(lx);
+  if (is_word(token, "elif")) {
+    if ((node->else_body = parse_if(lx, a)) == NULL)
+      return NULL;
+  }
+  else if (is_word(token, "else")) {
+    if ((node->else_body = parse_block(lx, a, fi_words)) == NULL || !expect(lx, "fi"))
+      return NULL;
+  }
+  else if (!is_word(token, "fi")) {
+    syntax_error(token);
+    return NULL;
+  }
+  return node;
+}
+
+
+// "while" or "until" was consumed
+static struct node *parse_while(struct lexer *lx, struct arena *a, bool until) {
+  struct node *node = new_node(NODE_WHILE, a);
+  if (node == NULL || (node->cond = parse_block(lx, a, do_words)) == NULL || !expect(lx, "do"))
+    return NULL;
+  if ((node->body = parse_block(lx, a, done_words)) == NULL || !expect(lx, "done"))
+    return NULL;
+  node->until = until;
+  return node;
+}
+
+
+// "for" was consumed: for name [in words...] ; do list done
+static struct node *parse_for(struct lexer *lx, struct arena *a) {
+
+  struct node *node = new_node(NODE_FOR, a);
+  char *name = lex_next(lx);
+  if (node == NULL || name == NULL || var_name_length(name) != strlen(name)) {
+    syntax_error(name);
+    return NULL;
+  }
+  node->name = name;
+
+  if (is_word(lex_peek(lx), "in")) {
+    lx->pos++;
+    node->has_in = true;
+    size_t start = lx->pos;
+    while (lx->tokens.items[lx->pos] != token_semi && lx->tokens.items[lx->pos] != token_newline)
+      lx->pos++;
+    node->num_words = lx->pos - start;
+    node->words = arena_alloc(a, (node->num_words + 1) * sizeof *node->words);
+    if (node->words == NULL)
+      return NULL;
+    memcpy(node->words, lx->tokens.items + start, node->num_words * sizeof *node->words);
+  }
+  if (lex_peek(lx) == token_semi)
+    lx->pos++;
+  skip_newlines(lx);
+  if (!expect(lx, "do") || (node->body = parse_block(lx, a, done_words)) == NULL || !expect(lx, "done"))
+    return NULL;
+  return node;
+}
+
+
+// The name was consumed: [newlines] { list }
+static struct node *parse_function(struct lexer *lx, struct arena *a, char *name) {
+  struct node *node = new_node(NODE_FUNCTION, a);
+  if (node == NULL || var_name_length(name) != strlen(name) || find_builtin(name) != NULL) {
+    fprintf(stderr, "Error, \"%s\" is not a valid function name.\n", name);
+    return NULL;
+  }
+  node->name = name;
+  skip_newlines(lx);
+  if (!expect(lx, "{") || (node->body = parse_block(lx, a, brace_words)) == NULL || !expect(lx, "}"))
+    return NULL;
+  return node;
+}
+
+
+// A simple command runs up to the next separator, "&" ends it too
+static struct node *parse_simple(struct lexer *lx, struct arena *a) {
+
+  size_t start = lx->pos;
+  while (true) {
+    char *token = lx->tokens.items[lx->pos];
+    if (token == token_semi || token == token_newline || is_word(token, "&&") || is_word(token, "||"))
+      break;
+    lx->pos++;
+    if (strcmp(token, "&") == 0)
+      break;
+  }
+
+  struct node *node = new_node(NODE_COMMAND, a);
+  if (node == NULL)
+    return NULL;
+  node->num_words = lx->pos - start;
+  node->words = arena_alloc(a, node->num_words * sizeof *node->words);
+  if (node->words == NULL)
+    return NULL;
+  memcpy(node->words, lx->tokens.items + start, node->num_words * sizeof *node->words);
+  return node;
+}
+
+
+static struct node *parse_command(struct lexer *lx, struct arena *a) {
+
+  char *token = lex_peek(lx);
+  size_t len = strlen(token);
+
+  if (is_one_of(token, reserved_words)) {
+    syntax_error(token);
+    return NULL;
+  }
+  if (strcmp(token, "if") == 0) {
+    lx->pos++;
+    return parse_if(lx, a);
+  }
+  if (strcmp(token, "while") == 0 || strcmp(token, "until") == 0) {
+    lx->pos++;
+    return parse_while(lx, a, token[0] == 'u');
+  }
+  if (strcmp(token, "for") == 0) {
+    lx->pos++;
+    return parse_for(lx, a);
+  }
+  if (strcmp(token, "function") == 0) {
+    lx->pos++;
+    char *name = lex_next(lx);
+    if (name == NULL || name == token_semi || name == token_newline) {
+      syntax_error(name);
+      return NULL;
+    }
+    size_t name_len = strlen(name);
+    if (name_len > 2 && strcmp(name + name_len - 2, "()") == 0)
+      name[name_len - 2] = '\0';
+    return parse_function(lx, a, name);
+  }
+  if (len > 2 && strcmp(token + len - 2, "()") == 0) {
+    lx->pos++;
+    token[len - 2] = '\0';
+    return parse_function(lx, a, token);
+  }
+  return parse_simple(lx, a);
+}
+
+
+static struct node *parse_and_or(struct lexer *lx, struct arena *a) {
+
+  struct node *left = parse_command(lx, a);
+  while (left != NULL) {
+    char *token = lex_peek(lx);
+    bool and = is_word(token, "&&");
+    if (!and && !is_word(token, "||"))
+      break;
+    lx->pos++;
+    // The input ran out (already reported) or a ";" left the right side empty
+    token = skip_newlines(lx);
+    if (token == NULL || token == token_semi) {
+      syntax_error(token);
+      return NULL;
+    }
+    struct node *node = new_node(and ? NODE_AND : NODE_OR, a);
+    if (node == NULL || (node->body = parse_command(lx, a)) == NULL)
+      return NULL;
+    node->cond = left;
+    left = node;
+  }
+  return left;
+}
+
+
+// Compiles the command on line into *program, reading more lines while an
+// if, while, for or function is still open. Returns -1 on a syntax error, -2 when out
+// of memory.
+int compile_line(struct lexer *lx, char *line, size_t len, struct node **program) {
+
+  lx->interrupted = false;
+  if (!lex_load(lx, line, len)) {
+    fprintf(stderr, "Error growing the word vector!\n");
+    return -2;
+  }
+  bool ok;
+  *program = parse_list(lx, &ast_arena, NULL, &ok);
+  return ok ? 0 : -1;
+}
+
+
+int parse_input(char **words, unsigned int num_words, struct parsed_tokens *pt, struct arena *a) {
+
+  unsigned int num_words_before_comments = num_words;
+  
+  for (int i = 0; i < num_words; i++) {
+    if (strcmp(words[i], "#") == 0) {
+      num_words_before_comments = i;
+      break;
+    }
+  }
+ 
+  if (num_words_before_comments < num_words)
+    num_words = num_words_before_comments;
+
+  // Check if the last word is an "&" and set run in background to True,
+  // the "&" itself is not part of the command
+  if (num_words > 0) {
+    if (strcmp(words[num_words - 1], "&") == 0) {
+      pt->will_run_in_bg = true;
+      num_words--;
+    }
+  }
+
+  // "time cmd ..." reports the pipeline's resource usage once it is done
+  if (num_words > 1 && strcmp(words[0], "time") == 0) {
+    pt->timed = true;
+    words++;
+    num_words--;
+  }
+
+  if (num_words == 0)
+    return 0;
+
+  // Each "|" ends a stage, the next one is chained through next_stage
+  struct parsed_tokens *stage = pt;
+  unsigned int start = 0;
+  for (unsigned int i = 0; i <= num_words; i++) {
+    if (i < num_words && strcmp(words[i], "|") != 0)
+      continue;
+    if (i == start) {
+      fprintf(stderr, "Error, pipeline with an empty command provided.\n");
+      return -1;
+    }
+    if (parse_stage(words + start, i - start, stage, a) < 0)
+      return -1;
+    if (i < num_words) {
+      struct parsed_tokens *next = arena_alloc(a, sizeof *next);
+      if (next == NULL)
+        return -1;
+      init_parsed_tokens_struct(next);
+      stage->next_stage = next;
+      stage = next;
+    }
+    start = i + 1;
+  }
+  return 0;
+}
+
+
+// Fills pt with one command of a pipeline: its name, arguments and redirections
+// Recognizes the redirection operator at the start of word: "[n]<", "[n]>",
+// "[n]>>", "[n]>&", "[n]<&", "&>" and "&>>". Fills in r except for the target
+// and returns the length of the operator, 0 when word is not one.
+static size_t parse_redirection(char const *word, struct redirection *r) {
+
+  char const *p = word;
+  int fd = -1;
+  if (p[0] == '&' && p[1] == '>')
+    p++;
+  else {
+    for (; isdigit((unsigned char)*p) && p - word < 6; p++)
+      fd = (fd == -1 ? 0 : fd * 10) + (*p - '0');
+  }
+  if (*p != '<' && *p != '>')
+    return 0;
+  bool input = *p++ == '<';
+  if (input && *p == '<')
+    return 0; // here-documents and here-strings are handled by the caller
+
+  r->fd = fd != -1 ? fd : input ? STDIN_FILENO : STDOUT_FILENO;
+  r->source = -1;
+  r->path = NULL;
+  if (input)
+    r->flags = O_RDONLY;
+  else if (*p == '>') {
+    r->flags = O_WRONLY | O_CREAT | O_APPEND;
+    p++;
+  }
+  else
+    r->flags = O_WRONLY | O_CREAT | O_TRUNC;
+  if (*p == '&' && word[0] != '&' && !(r->flags & O_APPEND))
+    p++;
+  return p - word;
+}
+
+
+int parse_stage(char **words, unsigned int num_words, struct parsed_tokens *pt, struct arena *a) {
+
+  // "@name=value" words before the command place its child
+  for (; num_words > 0 && words[0][0] == '@' && strchr(words[0], '='); words++, num_words--) {
+    if (pt->placement == NULL) {
+      pt->placement = arena_alloc(a, sizeof *pt->placement);
+      if (pt->placement == NULL)
+        return -1;
+      memset(pt->placement, 0, sizeof *pt->placement);
+    }
+    if (parse_placement(words[0], pt->placement) < 0)
+      return -1;
+  }
+  if (num_words == 0) {
+    fprintf(stderr, "Error, %s provided but no command provided.\n", words[-1]);
+    return -1;
+  }
+
+  // Set cmd and cmd_args accordingly
+  pt->cmd = words[0];
+
+  // Arguments and redirections may come in any order, "&>" takes two slots
+  char **argv = arena_alloc(a, (num_words + 1) * sizeof *argv);
+  pt->redirs = arena_alloc(a, 2 * num_words * sizeof *pt->redirs);
+  if (argv == NULL || pt->redirs == NULL)
+    return -1;
+  unsigned int argc = 0;
+  argv[argc++] = words[0];
+  pt->input_for_execvp = argv;
+  pt->cmd_args = argv + 1;
+
+  for (unsigned int i = 1; i < num_words; i++) {
+
+    struct redirection r;
+    size_t len = parse_redirection(words[i], &r);
+    if (len > 0) {
+      // The target is the rest of the word or the next one
+      char const *op = words[i];
+      char *target = words[i] + len;
+      if (*target == '\0') {
+        if (i + 1 >= num_words) {
+          fprintf(stderr, "Error, redirection operand %s provided but no following word provided.\n", op);
+          return -1;
+        }
+        target = words[++i];
+      }
+      bool both = op[0] == '&';
+      if (op[len - 1] == '&') {
+        // "n>&m" duplicates m, "n>&-" closes n and ">&file" is "&>file"
+        char *end;
+        long source = strtol(target, &end, 10);
+        if (strcmp(target, "-") == 0)
+          r.source = -1;
+        else if (isdigit((unsigned char)*target) && *end == '\0' && source < INT_MAX)
+          r.source = source;
+        else if (len == 2 && op[0] == '>') {
+          r.path = target;
+          both = true;
+        }
+        else {
+          fprintf(stderr, "Error, %s: not a file descriptor.\n", target);
+          return -1;
+        }
+      }
+      else
+        r.path = target;
+      pt->redirs[pt->num_redirs++] = r;
+      if (both)
+        pt->redirs[pt->num_redirs++] = (struct redirection){STDERR_FILENO, 0, STDOUT_FILENO, NULL};
+      continue;
+    }
+
+    // "<< body" from a here-document is fed to stdin as it is, "<<< word"
+    // with a newline added, a "<" redirection still takes precedence
+    if (strcmp(words[i], "<<") == 0 || strcmp(words[i], "<<<") == 0) {
+      if ((i + 1) >= num_words) {
+        fprintf(stderr, "Error, input redirection operand %s provided but no following word provided.\n", words[i]);
+        return -1;
+      }
+      char const *text = words[++i];
+      size_t len = strlen(text);
+      bool newline = words[i - 1][2] == '<';
+      pt->input_data = arena_alloc(a, len + newline + 1);
+      if (pt->input_data == NULL)
+        return -1;
+      memcpy(pt->input_data, text, len);
+      if (newline)
+        pt->input_data[len++] = '\n';
+      pt->input_data[len] = '\0';
+      continue;
+    }
+
+    argv[argc++] = words[i];
+  }
+  argv[argc] = NULL;
+  return 0;
+}
+
+
+void init_parsed_tokens_struct(struct parsed_tokens *pt) {
+  static char *no_args[1] = {NULL};
+  pt->cmd = NULL;
+  pt->next_stage = NULL;
+  pt->cmd_args = no_args;
+  pt->input_for_execvp = no_args;
+  pt->redirs = NULL;
+  pt->num_redirs = 0;
+  pt->input_data = NULL;
+  pt->timed = false;
+  pt->will_run_in_bg = 0;
+  pt->placement = NULL;
+}
+
+
+// Loads a script for batch mode, mmapped when it is a regular file and
+// read in large blocks otherwise (pipes, /dev/stdin)
+int open_script(struct input_source *in, char const *path) {
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+
+  in->kind = INPUT_BUFFER;
+  struct stat sb;
+  if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+    // A private writable mapping lets the tokenizer terminate words in place
+    void *map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      posix_madvise(map, sb.st_size, POSIX_MADV_SEQUENTIAL);
+      in->buf = map;
+      in->len = sb.st_size;
+      in->mapped = sb.st_size;
+      close(fd);
+      return 0;
+    }
+  }
+
+  size_t cap = 0;
+  while (true) {
+    if (in->len == cap) {
+      cap = cap ? cap * 2 : 65536;
+      char *buf = realloc(in->buf, cap);
+      if (buf == NULL) {
+        close(fd);
+        return -1;
+      }
+      in->buf = buf;
+      in->owned = true;
+    }
+    ssize_t got = read(fd, in->buf + in->len, cap - in->len);
+    if (got == 0)
+      break;
+    if (got < 0) {
+      if (errno == EINTR)
+        continue;
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    in->len += got;
+  }
+  close(fd);
+  return 0;
+}
+
+
+// Hands out the next line, '\n' included when present. Lines of a script in
+// memory are returned in place, returns -1 and sets in->eof at the end.
+ssize_t read_input_line(struct input_source *in, char **line) {
+
+  if (in->kind == INPUT_STDIN && in->interactive && editor.enabled)
+    return edit_line(&editor, in, line);
+
+  if (in->kind == INPUT_STDIN) {
+    ssize_t len = getline(&in->line, &in->n, stdin);
+    if (len == -1 && feof(stdin))
+      in->eof = true;
+    *line = in->line;
+    return len;
+  }
+
+  if (in->pos >= in->len) {
+    in->eof = true;
+    errno = 0;
+    return -1;
+  }
+
+  char *start = in->buf + in->pos;
+  size_t remaining = in->len - in->pos;
+  char *newline = memchr(start, '\n', remaining);
+  if (newline) {
+    size_t len = newline - start + 1;
+    in->pos += len;
+    *line = start;
+    return len;
+  }
+
+  // The last line has no '\n', copy it so there is room for the terminator
+  if (in->n < remaining + 1) {
+    char *buf = realloc(in->line, remaining + 1);
+    if (buf == NULL)
+      return -1;
+    in->line = buf;
+    in->n = remaining + 1;
+  }
+  memcpy(in->line, start, remaining);
+  in->line[remaining] = '\0';
+  in->pos = in->len;
+  *line = in->line;
+  return remaining;
+}
+
+
+void close_input(struct input_source *in) {
+  if (in->mapped)
+    munmap(in->buf, in->mapped);
+  else if (in->owned)
+    free(in->buf);
+  free(in->line);
+}
+
+
+// Opens the history file for appending, nothing of it is read yet
+void history_open(struct history *h, char const *path) {
+  h->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (h->fd == -1)
+    return;
+  if (!history_map(h)) {
+    close(h->fd);
+    h->fd = -1;
+  }
+}
+
+
+// Maps the file again when it grew, other shells may have appended too.
+// When something truncated it the entries and the index start over, pages
+// past the new end would raise SIGBUS.
+bool history_map(struct history *h) {
+
+  struct stat sb;
+  if (fstat(h->fd, &sb) == -1)
+    return false;
+  size_t size = sb.st_size;
+  if (size < h->mapped) {
+    munmap(h->map, h->mapped);
+    h->map = NULL;
+    h->mapped = h->len = h->indexed = 0;
+    h->num_blocks = h->block_fill = 0;
+    if (h->bits)
+      memset(h->bits, 0, HISTORY_HASHES * h->words_cap * sizeof *h->bits);
+    h->index_failed = false;
+  }
+  if (size > h->mapped) {
+    char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, h->fd, 0);
+    if (map == MAP_FAILED)
+      return false;
+    if (h->map)
+      munmap(h->map, h->mapped);
+    h->map = map;
+    h->mapped = size;
+  }
+
+  // A line still being written by another shell is not an entry yet
+  char *last = size > h->len ? memrchr(h->map + h->len, '\n', size - h->len) : NULL;
+  if (last != NULL)
+    h->len = last - h->map + 1;
+  return true;
+}
+
+
+// Appends a command line, unless it is empty, starts with a space or repeats
+// the last entry. It goes into the index right away once that caught up.
+void history_add(struct history *h, char const *line, size_t len) {
+
+  if (h->fd == -1 || len == 0 || line[0] == ' ' || !history_map(h))
+    return;
+  if (h->len > 0) {
+    size_t last = h->len - 1;
+    while (last > 0 && h->map[last - 1] != '\n')
+      last--;
+    if (h->len - 1 - last == len && memcmp(h->map + last, line, len) == 0)
+      return;
+  }
+
+  // One write, so entries of shells sharing the file never interleave
+  bool caught_up = h->indexed == h->len;
+  struct iovec iov[3] = {{"\n", h->mapped > h->len ? 1 : 0}, {(char *)line, len}, {"\n", 1}};
+  if (writev(h->fd, iov, 3) == -1)
+    return;
+  history_map(h);
+  if (caught_up)
+    history_index(h, SIZE_MAX);
+}
+
+
+// Hash of the n (1 to 3) bytes at p, a row of the index
+static uint32_t history_gram(unsigned char const *p, size_t n) {
+  uint32_t gram = (uint32_t)n << 24 | p[0];
+  if (n > 1)
+    gram |= p[1] << 8;
+  if (n > 2)
+    gram |= p[2] << 16;
+  return (gram * 2654435761u) >> 20;
+}
+
+
+// Marks the grams of the entry [start, end) in block b
+static void history_index_entry(struct history *h, size_t start, size_t end, size_t b) {
+  unsigned char const *p = (unsigned char const *)h->map;
+  for (size_t i = start; i < end; i++) {
+    for (size_t n = 1; n <= 3 && i + n <= end; n++)
+      h->bits[history_gram(p + i, n) * h->words_cap + b / 64] |= (uint64_t)1 << (b % 64);
+  }
+}
+
+
+// Adds up to budget bytes of entries to the index, false when out of memory
+bool history_index(struct history *h, size_t budget) {
+
+  size_t done = 0;
+  while (h->indexed < h->len && done < budget && !h->index_failed) {
+    if (h->num_blocks == 0 || h->block_fill == HISTORY_BLOCK) {
+      if (h->num_blocks == h->blocks_cap) {
+        size_t cap = h->blocks_cap ? 2 * h->blocks_cap : 64;
+        size_t *blocks = realloc(h->blocks, cap * sizeof *blocks);
+        if (blocks == NULL)
+          break;
+        h->blocks = blocks;
+        h->blocks_cap = cap;
+      }
+      // Every row gets room for twice the blocks, they are moved apart
+      if (h->num_blocks == h->words_cap * 64) {
+        size_t cap = h->words_cap ? 2 * h->words_cap : 1;
+        uint64_t *bits = calloc(HISTORY_HASHES * cap, sizeof *bits);
+        if (bits == NULL)
+          break;
+        for (size_t row = 0; row < HISTORY_HASHES && h->words_cap; row++)
+          memcpy(bits + row * cap, h->bits + row * h->words_cap, h->words_cap * sizeof *bits);
+        free(h->bits);
+        h->bits = bits;
+        h->words_cap = cap;
+      }
+      h->blocks[h->num_blocks++] = h->indexed;
+      h->block_fill = 0;
+    }
+    size_t end = (char *)memchr(h->map + h->indexed, '\n', h->len - h->indexed) - h->map;
+    history_index_entry(h, h->indexed, end, h->num_blocks - 1);
+    h->block_fill++;
+    done += end + 1 - h->indexed;
+    h->indexed = end + 1;
+  }
+  if (h->indexed < h->len && done < budget)
+    h->index_failed = true;
+  return !h->index_failed;
+}
+
+
+// Finds the last entry of [start, end) that starts before before and
+// contains the query
+static bool history_scan(struct history const *h, size_t start, size_t end, char const *query, size_t query_len,
+                         size_t before, size_t *entry) {
+  bool found = false;
+  char const *p = h->map + start;
+  char const *stop = h->map + end;
+  char const *hit;
+  while (p < stop && (hit = memmem(p, stop - p, query, query_len)) != NULL) {
+    char const *line = hit;
+    while (line > h->map + start && line[-1] != '\n')
+      line--;
+    if ((size_t)(line - h->map) >= before)
+      break;
+    *entry = line - h->map;
+    found = true;
+    char const *next = memchr(hit, '\n', stop - hit);
+    if (next == NULL)
+      break;
+    p = next + 1;
+  }
+  return found;
+}
+
+
+// Finds the newest entry starting before before that contains the query.
+// Only the blocks holding every trigram of the query are looked at.
+bool history_search(struct history *h, char const *query, size_t query_len, size_t before, size_t *entry) {
+
+  // Entries the index has not reached yet are the newest, they are scanned
+  // back from before a chunk at a time
+  if (h->fd == -1 || query_len == 0)
+    return false;
+  for (size_t hi = before < h->len ? before : h->len; hi > h->indexed;) {
+    size_t lo = hi - h->indexed > 64 * 1024 ? hi - 64 * 1024 : h->indexed;
+    char const *newline = lo > h->indexed ? memrchr(h->map + h->indexed, '\n', lo - h->indexed) : NULL;
+    lo = newline ? (size_t)(newline - h->map) + 1 : h->indexed;
+    if (history_scan(h, lo, hi, query, query_len, before, entry))
+      return true;
+    hi = lo;
+  }
+  if (h->num_blocks == 0)
+    return false;
+
+  // The block holding before is the last one that may match
+  size_t lo = 0;
+  size_t hi = h->num_blocks;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (h->blocks[mid] < before)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  size_t last = lo;
+
+  // The query's trigrams, or the whole query when it is shorter
+  uint32_t hashes[sizeof editor.query];
+  size_t num_hashes = 0;
+  size_t n = query_len < 3 ? query_len : 3;
+  for (size_t i = 0; i + n <= query_len && num_hashes < sizeof hashes / sizeof hashes[0]; i++)
+    hashes[num_hashes++] = history_gram((unsigned char const *)query + i, n);
+
+  for (size_t w = last / 64 + 1; w-- > 0;) {
+    uint64_t candidates = ~(uint64_t)0;
+    for (size_t i = 0; i < num_hashes; i++)
+      candidates &= h->bits[hashes[i] * h->words_cap + w];
+    if (w == last / 64 && last % 64 != 63)
+      candidates &= ((uint64_t)1 << (last % 64 + 1)) - 1;
+    while (candidates) {
+      size_t b = w * 64 + 63 - __builtin_clzll(candidates);
+      candidates &= ~((uint64_t)1 << (b % 64));
+      size_t end = b + 1 < h->num_blocks ? h->blocks[b + 1] : h->indexed;
+      if (history_scan(h, h->blocks[b], end, query, query_len, before, entry))
+        return true;
+    }
+  }
+  return false;
+}
+
+
+// Offset of the '\n' ending the entry that starts at entry
+size_t history_entry_end(struct history const *h, size_t entry) {
+  return (char *)memchr(h->map + entry, '\n', h->len - entry) - h->map;
+}
+
+
+// Makes room for len bytes and the "\n\0" added when the line is done
+static bool edit_reserve(struct line_editor *ed, size_t len) {
+  struct input_source *in = ed->in;
+  if (in->line != NULL && in->n >= len + 2)
+    return true;
+  size_t n = in->n ? in->n : 128;
+  while (n < len + 2)
+    n *= 2;
+  char *line = realloc(in->line, n);
+  if (line == NULL)
+    return false;
+  in->line = line;
+  in->n = n;
+  return true;
+}
+
+
+// Replaces the line with text, the cursor goes to its end
+static void edit_set(struct line_editor *ed, char const *text, size_t len) {
+  if (!edit_reserve(ed, len))
+    return;
+  memmove(ed->in->line, text, len);
+  ed->len = ed->pos = len;
+}
+
+
+// Catches up with the history file before the editor reads it, an entry
+// shown or found in a file that was truncated since is gone
+static void edit_sync_history(struct line_editor *ed) {
+  size_t old_len = history.len;
+  if (history.fd == -1)
+    return;
+  history_map(&history);
+  if (history.len < old_len) {
+    ed->nav = history.len;
+    ed->found = false;
+  }
+  else if (ed->nav == old_len) {
+    ed->nav = history.len;
+  }
+}
+
+
+// Moves to the history entry at entry, history.len goes back to the line
+// that was being typed
+static void edit_show_entry(struct line_editor *ed, size_t entry) {
+  if (ed->nav == history.len && entry != history.len) {
+    free(ed->saved);
+    ed->saved = malloc(ed->len + 1);
+    if (ed->saved == NULL)
+      return;
+    memcpy(ed->saved, ed->in->line, ed->len);
+    ed->saved[ed->len] = '\0';
+  }
+  ed->nav = entry;
+  if (entry == history.len)
+    edit_set(ed, ed->saved ? ed->saved : "", ed->saved ? strlen(ed->saved) : 0);
+  else
+    edit_set(ed, history.map + entry, history_entry_end(&history, entry) - entry);
+}
+
+
+// Terminal columns a byte string takes, UTF-8 continuation bytes take none
+static size_t edit_width(char const *s, size_t len) {
+  size_t width = 0;
+  for (size_t i = 0; i < len; i++)
+    width += ((unsigned char)s[i] & 0xC0) != 0x80;
+  return width;
+}
+
+
+// Redraws the prompt and the line on the current row, scrolled sideways
+// when it does not fit
+void edit_refresh(struct line_editor *ed) {
+
+  char search_prompt[sizeof ed->query + 40];
+  char const *prompt = ed->prompt;
+  char const *text = ed->in->line ? ed->in->line : "";
+  size_t len = ed->len;
+  size_t pos = ed->pos;
+  if (ed->searching) {
+    snprintf(search_prompt, sizeof search_prompt, "(%sreverse-i-search)`%.*s': ",
+             ed->found || ed->query_len == 0 ? "" : "failing ", (int)ed->query_len, ed->query);
+    prompt = search_prompt;
+    if (ed->found) {
+      text = history.map + ed->match;
+      len = history_entry_end(&history, ed->match) - ed->match;
+      char const *hit = memmem(text, len, ed->query, ed->query_len);
+      pos = hit ? (size_t)(hit - text) : 0;
+    }
+  }
+
+  struct winsize ws;
+  size_t cols = ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+  size_t prompt_width = edit_width(prompt, strlen(prompt));
+  size_t start = 0;
+  while (start < pos && prompt_width + edit_width(text + start, pos - start) >= cols)
+    start++;
+  size_t end = pos;
+  while (end < len && prompt_width + edit_width(text + start, end + 1 - start) < cols)
+    end++;
+  while (end < len && ((unsigned char)text[end] & 0xC0) == 0x80)
+    end++;
+
+  // One write, so the line never shows half drawn
+  char *out = malloc(strlen(prompt) + (end - start) + 32);
+  if (out == NULL)
+    return;
+  char *p = out;
+  *p++ = '\r';
+  p = stpcpy(p, prompt);
+  memcpy(p, text + start, end - start);
+  p += end - start;
+  p = stpcpy(p, "\x1b[0K\r");
+  size_t column = prompt_width + edit_width(text + start, pos - start);
+  if (column > 0)
+    p += sprintf(p, "\x1b[%zuC", column);
+  for (char const *q = out; q < p;) {
+    ssize_t wrote = write(STDERR_FILENO, q, p - q);
+    if (wrote <= 0 && errno != EINTR)
+      break;
+    if (wrote > 0)
+      q += wrote;
+  }
+  free(out);
+}
+
+
+// Reads a key, children finishing meanwhile are reported. Returns -1 at the
+// end of input and with errno EINTR on CTRL-C.
+static int edit_read_key(void) {
+  unsigned char c;
+  while (true) {
+    if (wait_for_input(&events, &env) < 0)
+      return -1;
+    ssize_t got = read(STDIN_FILENO, &c, 1);
+    if (got == 1)
+      break;
+    if (got == 0) {
+      errno = 0;
+      return -1;
+    }
+    if (errno != EAGAIN)
+      return -1;
+  }
+  if (c != 27)
+    return c;
+
+  // ESC [ or ESC O and a letter, or ESC [ and digits ended by '~'
+  int next = edit_read_key();
+  if (next != '[' && next != 'O')
+    return next;
+  int key = edit_read_key();
+  int number = 0;
+  while (key >= '0' && key <= '9') {
+    number = number * 10 + key - '0';
+    key = edit_read_key();
+  }
+  if (key == '~') {
+    switch (number) {
+      case 1: case 7: return KEY_HOME;
+      case 4: case 8: return KEY_END;
+      case 3: return KEY_DELETE;
+    }
+    return 0;
+  }
+  switch (key) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+  }
+  return key == -1 ? -1 : 0;
+}
+
+
+// Steps over one character left or right of pos, UTF-8 sequences as a whole
+static size_t edit_prev(struct line_editor const *ed, size_t pos) {
+  while (pos > 0 && ((unsigned char)ed->in->line[--pos] & 0xC0) == 0x80)
+    ;
+  return pos;
+}
+
+static size_t edit_next(struct line_editor const *ed, size_t pos) {
+  while (pos < ed->len && ((unsigned char)ed->in->line[++pos] & 0xC0) == 0x80)
+    ;
+  return pos;
+}
+
+
+// Removes [from, to) of the line
+static void edit_delete(struct line_editor *ed, size_t from, size_t to) {
+  memmove(ed->in->line + from, ed->in->line + to, ed->len - to);
+  ed->len -= to - from;
+  ed->pos = from;
+}
+
+
+// Handles a key in Ctrl-R, returns true when it also needs normal handling
+static bool edit_search_key(struct line_editor *ed, int key) {
+
+  size_t entry;
+  if (key == 18) {
+    // Ctrl-R again goes on to an older match
+    if (ed->found && history_search(&history, ed->query, ed->query_len, ed->match, &entry))
+      ed->match = entry;
+    return false;
+  }
+  if (key == 7) {
+    // Ctrl-G gives the line back as it was
+    ed->searching = false;
+    return false;
+  }
+  if (key == 127 || key == 8) {
+    if (ed->query_len > 0)
+      ed->query_len--;
+    ed->found = history_search(&history, ed->query, ed->query_len, history.len, &ed->match);
+    return false;
+  }
+  if (key >= 32 && key < 256 && key != 127) {
+    if (ed->query_len < sizeof ed->query)
+      ed->query[ed->query_len++] = key;
+    // The entry shown stays while it still matches
+    size_t before = ed->found ? ed->match + 1 : history.len;
+    ed->found = history_search(&history, ed->query, ed->query_len, before, &ed->match);
+    return false;
+  }
+
+  // Anything else takes the match and is handled as usual
+  ed->searching = false;
+  if (ed->found) {
+    ed->nav = history.len;
+    edit_set(ed, history.map + ed->match, history_entry_end(&history, ed->match) - ed->match);
+  }
+  return true;
+}
+
+
+// Reads a line from the terminal with editing, Up/Down through the history
+// and Ctrl-R searching it. Returns like read_input_line().
+ssize_t edit_line(struct line_editor *ed, struct input_source *in, char **line) {
+
+  // Keys come one by one, the terminal still turns Ctrl-C into SIGINT
+  struct termios cooked;
+  if (tcgetattr(STDIN_FILENO, &cooked) == -1) {
+    ed->enabled = false;
+    return read_input_line(in, line);
+  }
+  struct termios raw = cooked;
+  raw.c_iflag &= ~(ICRNL | IXON | BRKINT | INPCK | ISTRIP);
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+  ed->in = in;
+  ed->len = ed->pos = 0;
+  ed->nav = history.len;
+  ed->searching = false;
+  ed->last_key = 0;
+  ed->active = true;
+  ssize_t result = -1;
+  if (!edit_reserve(ed, 0))
+    goto done;
+
+  while (true) {
+    int key = edit_read_key();
+    if (key == -1) {
+      // Ctrl-C keeps errno EINTR, the end of input or an error ends the shell
+      if (errno != EINTR)
+        in->eof = true;
+      goto done;
+    }
+    edit_sync_history(ed);
+    if (ed->searching && !edit_search_key(ed, key)) {
+      edit_refresh(ed);
+      continue;
+    }
+
+    switch (key) {
+      case '\r':
+      case '\n':
+        ed->pos = ed->len;
+        edit_refresh(ed);
+        write(STDERR_FILENO, "\n", 1);
+        history_add(&history, in->line, ed->len);
+        in->line[ed->len] = '\n';
+        in->line[ed->len + 1] = '\0';
+        result = ed->len + 1;
+        goto done;
+      case 4: // Ctrl-D ends the input on an empty line
+        if (ed->len == 0) {
+          in->eof = true;
+          errno = 0;
+          goto done;
+        }
+        // fallthrough
+      case KEY_DELETE:
+        if (ed->pos < ed->len)
+          edit_delete(ed, ed->pos, edit_next(ed, ed->pos));
+        break;
+      case 127:
+      case 8:
+        if (ed->pos > 0)
+          edit_delete(ed, edit_prev(ed, ed->pos), ed->pos);
+        break;
+      case 1:
+      case KEY_HOME:
+        ed->pos = 0;
+        break;
+      case 5:
+      case KEY_END:
+        ed->pos = ed->len;
+        break;
+      case 2:
+      case KEY_LEFT:
+        ed->pos = edit_prev(ed, ed->pos);
+        break;
+      case 6:
+      case KEY_RIGHT:
+        ed->pos = edit_next(ed, ed->pos);
+        break;
+      case 11: // Ctrl-K
+        ed->len = ed->pos;
+        break;
+      case 21: // Ctrl-U
+        edit_delete(ed, 0, ed->pos);
+        break;
+      case 23: { // Ctrl-W deletes the word before the cursor
+        size_t from = ed->pos;
+        while (from > 0 && in->line[from - 1] == ' ')
+          from--;
+        while (from > 0 && in->line[from - 1] != ' ')
+          from--;
+        edit_delete(ed, from, ed->pos);
+        break;
+      }
+      case 12: // Ctrl-L
+        write(STDERR_FILENO, "\x1b[H\x1b[2J", 7);
+        break;
+      case 16:
+      case KEY_UP:
+        if (ed->nav > 0 && history.len > 0) {
+          size_t entry = ed->nav - 1;
+          while (entry > 0 && history.map[entry - 1] != '\n')
+            entry--;
+          edit_show_entry(ed, entry);
+        }
+        break;
+      case 14:
+      case KEY_DOWN:
+        if (ed->nav < history.len)
+          edit_show_entry(ed, history_entry_end(&history, ed->nav) + 1);
+        break;
+      case 9:
+        edit_complete(ed);
+        break;
+      case 18: // Ctrl-R
+        if (history.fd != -1) {
+          ed->searching = true;
+          ed->query_len = 0;
+          ed->found = false;
+        }
+        break;
+      default:
+        if (key >= 32 && key < 256 && edit_reserve(ed, ed->len + 1)) {
+          memmove(in->line + ed->pos + 1, in->line + ed->pos, ed->len - ed->pos);
+          in->line[ed->pos++] = key;
+          ed->len++;
+        }
+    }
+    ed->last_key = key;
+    edit_refresh(ed);
+  }
+
+done:
+  ed->active = false;
+  free(ed->saved);
+  ed->saved = NULL;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+  *line = in->line;
+  return result;
+}
+
+
+// Splits line[0..len) on any of delims (and '\n') into (offset, length) slices.
+// Reentrant, the line is not modified. Returns the number of slices in tv.
+size_t tokenize(char const *line, size_t len, char const *delims, struct token_vec *tv) {
+
+  // One lookup per byte instead of a strchr() over the delimiters
+  bool is_delim[256] = {false};
+  for (char const *d = delims; *d; d++)
+    is_delim[(unsigned char)*d] = true;
+  is_delim['\n'] = true;
+
+  tv->len = 0;
+  size_t i = 0;
+  while (i < len) {
+    while (i < len && is_delim[(unsigned char)line[i]])
+      i++;
+    if (i == len)
+      break;
+    size_t start = i;
+    while (i < len && !is_delim[(unsigned char)line[i]])
+      i++;
+    if (!token_vec_push(tv, start, i - start)) {
+      fprintf(stderr, "Error growing the token vector!\n");
+      break;
+    }
+  }
+  return tv->len;
+}
+
+
+bool token_vec_push(struct token_vec *tv, size_t offset, size_t length) {
+  if (tv->len == tv->cap) {
+    size_t cap = tv->cap ? tv->cap * 2 : 64;
+    struct token_slice *items = realloc(tv->items, cap * sizeof *items);
+    if (items == NULL)
+      return false;
+    tv->items = items;
+    tv->cap = cap;
+  }
+  tv->items[tv->len].offset = offset;
+  tv->items[tv->len].length = length;
+  tv->len++;
+  return true;
+}
+
+
+bool ptr_vec_push(struct ptr_vec *v, char *ptr) {
+  if (v->len == v->cap) {
+    size_t cap = v->cap ? v->cap * 2 : 64;
+    char **items = realloc(v->items, cap * sizeof *items);
+    if (items == NULL)
+      return false;
+    v->items = items;
+    v->cap = cap;
+  }
+  v->items[v->len++] = ptr;
+  return true;
+}
+
+
+void print_env_struct(struct env_vars *env) {
+  fprintf(stderr, "Home is: %s\n", var_get(&env->vars, "HOME"));
+  fprintf(stderr, "IFS is: %s\n", var_get(&env->vars, "IFS"));
+  fprintf(stderr, "PS1 is: %s\n", var_get(&env->vars, "PS1"));
+  fprintf(stderr, "Last bg pid is: %jd\n", (intmax_t)env->last_bg_pid);
+  fprintf(stderr, "Last fg status is: %d\n", env->last_status);
+  fprintf(stderr, "SMALLSH process is: %jd\n", (intmax_t)env->shell_pid);
+}
+
+
+void print_parsed_tokens_struct(struct parsed_tokens *pt) {
+  fprintf(stderr, "pt->cmd: %s\n", pt->cmd);
+  for (int i = 0; pt->cmd_args[i]; i++)
+    fprintf(stderr, "pt->cmd_args[%d]: %s\n", i, pt->cmd_args[i]);
+  
+  for (int i = 0; pt->input_for_execvp[i]; i++)
+    fprintf(stderr, "pt->input_for_execvp[%d]: %s\n", i, pt->input_for_execvp[i]);
+  
+  for (size_t i = 0; i < pt->num_redirs; i++) {
+    char buf[64];
+    format_redirection(buf, &pt->redirs[i]);
+    fprintf(stderr, "pt->redirs[%zu]: %s%s\n", i, buf, pt->redirs[i].path ? pt->redirs[i].path : "");
+  }
+  fprintf(stderr, "pt->will_run_in_bg: %d\n", pt->will_run_in_bg);
+
+}
+
+
+void print_prompt(struct env_vars *env) {
+  char const *ps1 = var_get(&env->vars, "PS1");
+  show_prompt(ps1 ? ps1 : "$");
+}
+
+
+// Prints prompt and a space, and keeps it for the line editor to redraw
+void show_prompt(char const *prompt) {
+  snprintf(editor.prompt, sizeof editor.prompt, "%s ", prompt);
+  fputs(editor.prompt, stderr);
+}
+
+
+void init_env_vars(struct env_vars *env) {
+
+    // Every variable of the environment starts out exported
+    for (char **e = environ; *e != NULL; e++) {
+      size_t len = var_name_length(*e);
+      if (len == 0 || (*e)[len] != '=')
+        continue;
+      if (!var_set(&env->vars, *e, len, *e + len + 1)) {
+        fprintf(stderr, "Error mallocing for the environment variables!\n");
+        exit(1);
+      }
+      var_export(&env->vars, var_lookup(&env->vars, *e, len));
+    }
+
+    // $$ is fixed for good, children never see this copy change
+    env->shell_pid = getpid();
+    env->last_status = 0;
+    env->last_bg_pid = 0;
+
+    // Any nonzero seed will do for xorshift
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    env->random_state = (uint32_t)(now.tv_nsec ^ (now.tv_sec << 16) ^ env->shell_pid) | 1;
+}
+
+// Sets $? from a wait status, signals become 128 + [n]
+void update_last_fg_status(struct env_vars *env, int status) {
+  env->last_status = WIFSIGNALED(status) ? WTERMSIG(status) + 128 : WEXITSTATUS(status);
+}
+
+
+void update_last_bg_pid(struct env_vars *env, pid_t pid) {
+  env->last_bg_pid = pid;
+}
+
+
+void free_env_vars_struct(struct env_vars *env) {
+    for (size_t i = 0; i < env->vars.capacity; i++)
+      free(env->vars.slots[i].entry);
+    free(env->vars.slots);
+    free(env->vars.envp);
+}
+
+
+// Runs text in a forked copy of the shell with its stdout on a pipe. What it
+// prints is read into a buffer that doubles as it fills, trailing newlines are
+// dropped by shortening it.
+void run_substitution(struct env_vars *env, char const *text, size_t len, struct subst_result *result) {
+
+  result->text = NULL;
+  result->len = 0;
+  substitutions.status = 1;
+  substitutions.runs++;
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) == -1) {
+    perror("Error creating the substitution pipe");
+    return;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork()");
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    run_subshell(env, text, len);
+  }
+  close(fds[1]);
+
+  size_t cap = 4096;
+  char *buf = malloc(cap);
+  size_t used = 0;
+  while (buf != NULL) {
+    if (used == cap) {
+      char *bigger = realloc(buf, cap * 2);
+      if (bigger == NULL) {
+        fprintf(stderr, "Error mallocing for the substitution output!\n");
+        break;
+      }
+      buf = bigger;
+      cap *= 2;
+    }
+    ssize_t got = read(fds[0], buf + used, cap - used);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      break;
+    used += got;
+  }
+  close(fds[0]);
+
+  int status;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    ;
+  if (WIFEXITED(status))
+    substitutions.status = WEXITSTATUS(status);
+  else if (WIFSIGNALED(status))
+    substitutions.status = 128 + WTERMSIG(status);
+  if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+    interp.interrupted = true;
+
+  while (used > 0 && buf[used - 1] == '\n')
+    used--;
+  result->text = buf;
+  result->len = buf ? used : 0;
+}
+
+
+// Child side of a command substitution: text is compiled and run by this
+// copy of the shell, which then exits with its status
+void run_subshell(struct env_vars *env, char const *text, size_t len) {
+
+  in_subshell = true;
+  job_control = false;
+  signal(SIGINT, SIG_DFL);
+
+  // The zygote's socket and the epoll instance are shared with the parent,
+  // this process gets an event loop of its own and launches directly
+  if (launch_engine == LAUNCH_ZYGOTE)
+    launch_engine = LAUNCH_SPAWN;
+  sigset_t sigmask = shell_sigmask;
+  close(events.epfd);
+  close(events.sigfd);
+  for (size_t i = 0; i < events.len; i++)
+    close(events.children[i].pidfd);
+  free(events.children);
+  memset(&events, 0, sizeof events);
+  init_event_loop(&events, false);
+  shell_sigmask = sigmask;
+
+  // There are no more lines to read, a construct left open is an error
+  static struct input_source no_input = {INPUT_BUFFER};
+  lexer.in = &no_input;
+  lexer.line = NULL;
+  char *line = strndup(text, len);
+  struct node *program = NULL;
+  if (line == NULL || compile_line(&lexer, line, len, &program) < 0)
+    _exit(2);
+
+  interp.breaking = interp.continuing = 0;
+  interp.returning = interp.interrupted = false;
+  subshell_exec = program != NULL && program->next == NULL && program->kind == NODE_COMMAND;
+  exec_list(env, program);
+  fflush(stdout);
+  _exit(env->last_status);
+}
+
+
+void expand_variables(char **split_words, unsigned int num_words, struct env_vars *env, struct arena *a) {
+ 
+  for (unsigned int i = 0; i < num_words; i++) {
+    // Words without anything to expand are left alone
+    if (split_words[i][0] != '~' && strchr(split_words[i], '$') == NULL)
+      continue;
+
+    char *expanded = expand_word(split_words[i], env, a);
+    if (expanded == NULL) {
+      fprintf(stderr, "Error mallocing for an expanded word!\n");
+      continue;
+    }
+    split_words[i] = expanded;
+  }
+}
+
+
+char *expand_word(char const *word, struct env_vars *env, struct arena *a) {
+
+  // First pass only measures, the second fills the buffer sized by the first
+  substitutions.len = 0;
+  size_t len = expand_word_into(word, env, NULL);
+  char *out = arena_alloc(a, len + 1);
+  if (out != NULL) {
+    substitutions.next = 0;
+    expand_word_into(word, env, out);
+    out[len] = '\0';
+  }
+
+  // $? inside the word was the same in both passes, now it is the substitution's
+  for (size_t i = 0; i < substitutions.len; i++)
+    free(substitutions.items[i].text);
+  if (substitutions.len > 0)
+    env->last_status = substitutions.status;
+  substitutions.len = 0;
+  return out;
+}
+
+
+// The ')' closing a command substitution, p is just past its "$("
+static char const *subst_end(char const *p) {
+  int depth = 1;
+  for (; *p; p++) {
+    if (*p == '(')
+      depth++;
+    else if (*p == ')' && --depth == 0)
+      return p;
+  }
+  return NULL;
+}
+
+
+// Appends src to out (when out is not NULL) and returns the new length
+static size_t emit(char *out, size_t len, char const *src, size_t src_len) {
+  if (out)
+    memcpy(out + len, src, src_len);
+  return len + src_len;
+}
+
+
+// Scans word once, replacing "~/" at its start, $$, $?, $!, ${NAME}, $NAME and
+// $(command).
+// Returns the length of the expansion, writing it to out unless out is NULL.
+size_t expand_word_into(char const *word, struct env_vars *env, char *out) {
+  size_t len = 0;
+  char const *p = word;
+  char buf[24];
+
+  // Both passes must draw the same $RANDOM values, only the filling one keeps them
+  uint32_t random_state = env->random_state;
+
+  if (p[0] == '~' && p[1] == '/') {
+    char const *home = var_get(&env->vars, "HOME");
+    if (home)
+      len = emit(out, len, home, strlen(home));
+    len = emit(out, len, "/", 1);
+    p += 2;
+  }
+
+  while (*p) {
+    // Copy the literal run up to the next '$' in one go
+    char const *dollar = strchr(p, '$');
+    if (dollar == NULL) {
+      len = emit(out, len, p, strlen(p));
+      break;
+    }
+    len = emit(out, len, p, dollar - p);
+    p = dollar + 1;
+
+    // $(command) runs while measuring and is only copied when filling
+    char const *close;
+    if (*p == '(' && (close = subst_end(p + 1)) != NULL) {
+      if (out == NULL) {
+        if (substitutions.len == substitutions.cap) {
+          size_t cap = substitutions.cap ? substitutions.cap * 2 : 4;
+          struct subst_result *items = realloc(substitutions.items, cap * sizeof *items);
+          if (items == NULL) {
+            p = close + 1;
+            continue;
+          }
+          substitutions.items = items;
+          substitutions.cap = cap;
+        }
+        struct subst_result *result = &substitutions.items[substitutions.len++];
+        run_substitution(env, p + 1, close - p - 1, result);
+        len += result->len;
+      }
+      else if (substitutions.next < substitutions.len) {
+        struct subst_result *result = &substitutions.items[substitutions.next++];
+        len = emit(out, len, result->text, result->len);
+      }
+      p = close + 1;
+      continue;
+    }
+
+    // The name is a single special character or digit, ${...}, or a run of name characters
+    char const *name = p;
+    size_t name_len;
+    if (*p == '{') {
+      char const *close = strchr(p, '}');
+      if (close == NULL || close == p + 1) {
+        len = emit(out, len, "$", 1);
+        continue;
+      }
+      name = p + 1;
+      name_len = close - name;
+      p = close + 1;
+    }
+    else if ((*p && strchr("$?!#", *p) != NULL) || isdigit((unsigned char)*p)) {
+      name_len = 1;
+      p++;
+    }
+    else if ((name_len = var_name_length(p)) > 0) {
+      p += name_len;
+    }
+    else {
+      // A lone '$' is kept as is
+      len = emit(out, len, "$", 1);
+      continue;
+    }
+
+    char const *value = special_param(env, name, name_len, buf, &random_state);
+    if (value == NULL) {
+      struct var *v = var_lookup(&env->vars, name, name_len);
+      value = v ? v->entry + v->name_len + 1 : NULL;
+    }
+    if (value)
+      len = emit(out, len, value, strlen(value));
+  }
+
+  if (out)
+    env->random_state = random_state;
+  return len;
+}
+
+
+// Writes value in decimal to buf, which needs room for 21 characters
+static char *format_int(intmax_t value, char *buf) {
+  char *p = buf + 21;
+  uintmax_t magnitude = value < 0 ? -(uintmax_t)value : (uintmax_t)value;
+  *--p = '\0';
+  do {
+    *--p = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0)
+    *--p = '-';
+  return p;
+}
+
+
+// Value of the special parameter called name, or NULL if it is not one. Integers
+// are formatted into buf, a 24 byte scratch buffer, only when asked for.
+char const *special_param(struct env_vars *env, char const *name, size_t name_len, char *buf,
+                          uint32_t *random_state) {
+
+  if (name_len == 1) {
+    switch (name[0]) {
+      case '$':
+        return format_int(env->shell_pid, buf);
+      case '?':
+        return format_int(env->last_status, buf);
+      case '!':
+        return env->last_bg_pid ? format_int(env->last_bg_pid, buf) : "";
+      case '#':
+        return format_int(env->num_positional, buf);
+      case '0':
+        return env->arg0;
+    }
+  }
+
+  // $1 ... $9, and ${10} onwards
+  if (isdigit((unsigned char)name[0])) {
+    size_t n = 0;
+    for (size_t i = 0; i < name_len; i++) {
+      if (!isdigit((unsigned char)name[i]) || n > INT32_MAX / 10)
+        return "";
+      n = n * 10 + (name[i] - '0');
+    }
+    return n >= 1 && n <= (size_t)env->num_positional ? env->positional[n - 1] : "";
+  }
+
+  // $RANDOM gives 0 to 32767, an assigned RANDOM is a plain variable
+  if (name_len == 6 && memcmp(name, "RANDOM", 6) == 0 && var_lookup(&env->vars, name, name_len) == NULL) {
+    uint32_t x = *random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *random_state = x;
+    return format_int(x & 0x7fff, buf);
+  }
+  return NULL;
+}
+
+// Field splitting and pathname expansion of every expanded word into out,
+// source holds the words as written. Returns the new number of words.
+size_t expand_fields(char **source, char **words, size_t num_words, struct ptr_vec *out, struct env_vars *env,
+                     struct arena *a) {
+  out->len = 0;
+  bool assigning = true;
+  for (size_t i = 0; i < num_words; i++) {
+    // Leading NAME=value words are assigned as they are
+    size_t name_len = var_name_length(source[i]);
+    assigning = assigning && name_len > 0 && source[i][name_len] == '=';
+    // Nor are here-document bodies and here-strings
+    bool data = i > 0 && (strcmp(source[i - 1], "<<") == 0 || strcmp(source[i - 1], "<<<") == 0);
+    if (assigning || data) {
+      if (!ptr_vec_push(out, words[i]))
+        break;
+      continue;
+    }
+    if (!expand_field(source[i], words[i], out, env, a)) {
+      fprintf(stderr, "Error mallocing for the pathname expansion!\n");
+      break;
+    }
+  }
+  return out->len;
+}
+
+
+// What a command substitution printed is split on IFS into separate words, an
+// empty one leaves no word at all. Variables are never split. Each field then
+// goes through pathname expansion, word is split in place.
+bool expand_field(char const *source, char *word, struct ptr_vec *out, struct env_vars *env, struct arena *a) {
+
+  if (strstr(source, "$(") == NULL)
+    return glob_word(word, out, a);
+
+  char const *ifs = var_get(&env->vars, "IFS");
+  struct delim_set ds;
+  init_delim_set(&ds, ifs ? ifs : " \t\n");
+  char *p = word;
+  while (true) {
+    while (*p && ds.member[(unsigned char)*p])
+      p++;
+    if (*p == '\0')
+      return true;
+    char *end = scan_delims(p, strlen(p), &ds);
+    if (end)
+      *end = '\0';
+    if (!glob_word(p, out, a))
+      return false;
+    if (end == NULL)
+      return true;
+    p = end + 1;
+  }
+}
+
+
+// Compiles one component, pattern[0..len). Returns false when out of memory.
+static bool glob_compile(char const *pattern, size_t len, struct glob_component *gc, struct arena *a) {
+
+  struct glob_op *ops = arena_alloc(a, (len + 1) * sizeof *ops);
+  char *text = arena_alloc(a, len + 1);
+  if (ops == NULL || text == NULL)
+    return false;
+
+  size_t n = 0;
+  size_t text_len = 0;
+  bool literal = true;
+  for (size_t i = 0; i < len; i++) {
+    char c = pattern[i];
+    struct glob_op *op = &ops[n++];
+    op->kind = GLOB_CHAR;
+    op->negate = false;
+    op->set = NULL;
+    if (c == '\\' && i + 1 < len) {
+      c = pattern[++i];
+    }
+    else if (c == '*') {
+      // Consecutive stars match what one does
+      if (n > 1 && ops[n - 2].kind == GLOB_STAR)
+        n--;
+      op->kind = GLOB_STAR;
+      literal = false;
+      continue;
+    }
+    else if (c == '?') {
+      op->kind = GLOB_ANY;
+      literal = false;
+      continue;
+    }
+    else if (c == '[') {
+      // A '[' without its ']' is an ordinary character
+      size_t j = i + 1;
+      bool negate = j < len && (pattern[j] == '!' || pattern[j] == '^');
+      if (negate)
+        j++;
+      size_t first = j;
+      while (j < len && (pattern[j] != ']' || j == first))
+        j++;
+      if (j < len) {
+        uint8_t *set = arena_alloc(a, 32);
+        if (set == NULL)
+          return false;
+        memset(set, 0, 32);
+        for (size_t k = first; k < j; k++) {
+          unsigned char lo = pattern[k];
+          unsigned char hi = lo;
+          if (k + 2 < j && pattern[k + 1] == '-') {
+            hi = pattern[k + 2];
+            k += 2;
+          }
+          for (unsigned ch = lo; ch <= hi; ch++)
+            set[ch >> 3] |= 1 << (ch & 7);
+        }
+        op->kind = GLOB_CLASS;
+        op->negate = negate;
+        op->set = set;
+        literal = false;
+        i = j;
+        continue;
+      }
+    }
+    op->c = c;
+    text[text_len++] = c;
+  }
+  text[text_len] = '\0';
+
+  gc->ops = ops;
+  gc->num_ops = n;
+  gc->literal = literal ? text : NULL;
+  gc->dot = n > 0 && ops[0].kind == GLOB_CHAR && ops[0].c == '.';
+
+  // The literal ends let most names be turned down with one memcmp()
+  size_t head = 0;
+  while (head < n && ops[head].kind == GLOB_CHAR)
+    head++;
+  size_t tail = n;
+  while (tail > head && ops[tail - 1].kind == GLOB_CHAR)
+    tail--;
+  char *prefix = arena_alloc(a, head + (n - tail) + 2);
+  if (prefix == NULL)
+    return false;
+  for (size_t i = 0; i < head; i++)
+    prefix[i] = ops[i].c;
+  char *suffix = prefix + head + 1;
+  for (size_t i = tail; i < n; i++)
+    suffix[i - tail] = ops[i].c;
+  gc->prefix = prefix;
+  gc->prefix_len = head;
+  gc->suffix = suffix;
+  gc->suffix_len = n - tail;
+  return true;
+}
+
+
+// Matches name against a compiled component. A star remembers where it
+// started so a mismatch later only retries from there, never backtracking
+// further than the last star.
+static bool glob_match(struct glob_component const *gc, char const *name) {
+
+  struct glob_op const *ops = gc->ops;
+  size_t o = 0;
+  size_t star = SIZE_MAX;
+  char const *star_name = NULL;
+
+  while (*name || o < gc->num_ops) {
+    if (o < gc->num_ops) {
+      struct glob_op const *op = &ops[o];
+      unsigned char c = *name;
+      if (op->kind == GLOB_STAR) {
+        star = o++;
+        star_name = name;
+        continue;
+      }
+      if (c != '\0') {
+        bool hit;
+        if (op->kind == GLOB_CHAR)
+          hit = c == op->c;
+        else if (op->kind == GLOB_ANY)
+          hit = true;
+        else
+          hit = ((op->set[c >> 3] >> (c & 7)) & 1) != op->negate;
+        if (hit) {
+          o++;
+          name++;
+          continue;
+        }
+      }
+    }
+    if (star == SIZE_MAX || *star_name == '\0')
+      return false;
+    o = star + 1;
+    name = ++star_name;
+  }
+  return true;
+}
+
+
+// Joins a directory prefix ("" or ending in '/') and a name in the arena
+static char *glob_join(char const *prefix, size_t prefix_len, char const *name, size_t name_len,
+                       bool slash, struct arena *a) {
+  char *path = arena_alloc(a, prefix_len + name_len + 2);
+  if (path == NULL)
+    return NULL;
+  memcpy(path, prefix, prefix_len);
+  memcpy(path + prefix_len, name, name_len);
+  if (slash)
+    path[prefix_len + name_len++] = '/';
+  path[prefix_len + name_len] = '\0';
+  return path;
+}
+
+
+struct glob_state {
+  struct glob_component *components;
+  size_t num_components;
+  bool trailing_slash;    // "pattern/" only matches directories
+  struct ptr_vec *out;
+  struct arena *a;
+  char *dirents;          // getdents64() buffer
+};
+
+
+// Matches components[comp...] inside the directory prefix names and adds
+// what matches to the output. Returns false when out of memory.
+static bool glob_dir(struct glob_state *gs, char const *prefix, size_t comp) {
+
+  size_t prefix_len = strlen(prefix);
+  if (comp == gs->num_components)
+    return ptr_vec_push(gs->out, (char *)prefix);
+
+  struct glob_component const *gc = &gs->components[comp];
+  bool last = comp + 1 == gs->num_components && !gs->trailing_slash;
+
+  // A component without a pattern needs no directory read
+  if (gc->literal) {
+    char *path = glob_join(prefix, prefix_len, gc->literal, strlen(gc->literal), !last, gs->a);
+    if (path == NULL)
+      return false;
+    if (!last)
+      return glob_dir(gs, path, comp + 1);
+    struct stat sb;
+    return fstatat(AT_FDCWD, path, &sb, AT_SYMLINK_NOFOLLOW) != 0 || ptr_vec_push(gs->out, path);
+  }
+
+  int fd = open(prefix_len ? prefix : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return true;
+
+  // Directories to descend into are only read after this one is closed, the
+  // getdents64() buffer is shared
+  struct ptr_vec subdirs = {0};
+  bool ok = true;
+  long got;
+  while (ok && (got = syscall(SYS_getdents64, fd, gs->dirents, GLOB_DIRENT_BUFFER)) > 0) {
+    for (long off = 0; off < got;) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(gs->dirents + off);
+      off += d->d_reclen;
+      char const *name = d->d_name;
+
+      if (name[0] == '.' && (!gc->dot || name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+      if (memcmp(name, gc->prefix, gc->prefix_len) != 0)
+        continue;
+      size_t name_len = strlen(name);
+      if (name_len < gc->prefix_len + gc->suffix_len ||
+          memcmp(name + name_len - gc->suffix_len, gc->suffix, gc->suffix_len) != 0)
+        continue;
+      if (!glob_match(gc, name))
+        continue;
+
+      // d_type says what most entries are, only links and file systems that
+      // leave it out need a stat()
+      if (!last && d->d_type != DT_DIR) {
+        struct stat sb;
+        if ((d->d_type != DT_LNK && d->d_type != DT_UNKNOWN) || fstatat(fd, name, &sb, 0) != 0 ||
+            !S_ISDIR(sb.st_mode))
+          continue;
+      }
+      char *path = glob_join(prefix, prefix_len, name, name_len, !last, gs->a);
+      if (path == NULL || !ptr_vec_push(last ? gs->out : &subdirs, path)) {
+        ok = false;
+        break;
+      }
+    }
+  }
+  close(fd);
+
+  for (size_t i = 0; ok && i < subdirs.len; i++)
+    ok = glob_dir(gs, subdirs.items[i], comp + 1);
+  free(subdirs.items);
+  return ok;
+}
+
+
+static void swap_strings(char **a, char **b) {
+  char *tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+
+// Multikey quicksort: partitions on one character at a time, so a long shared
+// prefix like "file_0001" is looked at once per level instead of by every
+// strcmp() of a comparison sort
+static void sort_strings(char **a, size_t n, size_t depth) {
+
+  while (n > 16) {
+    int pivot = (unsigned char)a[n / 2][depth];
+    size_t lt = 0;
+    size_t i = 0;
+    size_t gt = n;
+    while (i < gt) {
+      int c = (unsigned char)a[i][depth];
+      if (c < pivot)
+        swap_strings(&a[lt++], &a[i++]);
+      else if (c > pivot)
+        swap_strings(&a[i], &a[--gt]);
+      else
+        i++;
+    }
+    sort_strings(a, lt, depth);
+    sort_strings(a + gt, n - gt, depth);
+    if (pivot == 0)
+      return;
+    a += lt;
+    n = gt - lt;
+    depth++;
+  }
+
+  for (size_t i = 1; i < n; i++) {
+    for (size_t j = i; j > 0 && strcmp(a[j - 1] + depth, a[j] + depth) > 0; j--)
+      swap_strings(&a[j - 1], &a[j]);
+  }
+}
+
+
+// Adds the pathnames word matches to out, or word itself when it has no
+// pattern or nothing matches. Returns false when out of memory.
+bool glob_word(char *word, struct ptr_vec *out, struct arena *a) {
+
+  if (strpbrk(word, "*?[") == NULL)
+    return ptr_vec_push(out, word);
+
+  // Compile every component up front, '/' separates them and never matches
+  size_t num_components = 0;
+  for (char const *p = word; *p; p++)
+    num_components += *p == '/';
+  struct glob_component *components = arena_alloc(a, (num_components + 1) * sizeof *components);
+  if (components == NULL)
+    return false;
+
+  struct glob_state gs = {components, 0, false, out, a, NULL};
+  bool pattern = false;
+  char const *p = word;
+  while (*p) {
+    char const *end = strchr(p, '/');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    if (len > 0) {
+      if (!glob_compile(p, len, &components[gs.num_components], a))
+        return false;
+      pattern |= components[gs.num_components++].literal == NULL;
+    }
+    gs.trailing_slash = end != NULL;
+    p += len + (end != NULL);
+  }
+  // Brackets that are not a class, like the "[" command, are no pattern
+  if (!pattern)
+    return ptr_vec_push(out, word);
+
+  gs.dirents = malloc(GLOB_DIRENT_BUFFER);
+  if (gs.dirents == NULL)
+    return false;
+  size_t first = out->len;
+  bool ok = glob_dir(&gs, word[0] == '/' ? "/" : "", 0);
+  free(gs.dirents);
+  if (!ok)
+    return false;
+
+  if (out->len == first)
+    return ptr_vec_push(out, word);
+  sort_strings(out->items + first, out->len - first, 0);
+  return true;
+}
+
+
+// Returns the listing of dir ("" for the current one), read again only when
+// the directory's mtime moved. NULL when it cannot be read.
+struct dir_listing *listing_read(struct completion_cache *cc, char const *dir, bool executables) {
+
+  struct stat sb;
+  char const *path = *dir ? dir : ".";
+  if (stat(path, &sb) != 0 || !S_ISDIR(sb.st_mode))
+    return NULL;
+
+  struct dir_listing *l = NULL;
+  for (size_t i = 0; i < cc->len && l == NULL; i++) {
+    if (cc->dirs[i]->dev == sb.st_dev && cc->dirs[i]->ino == sb.st_ino)
+      l = cc->dirs[i];
+  }
+  if (l && l->mtime.tv_sec == sb.st_mtim.tv_sec && l->mtime.tv_nsec == sb.st_mtim.tv_nsec &&
+      (l->executables || !executables))
+    return l;
+
+  if (l == NULL) {
+    // Past the limit the oldest directory that is not on PATH goes
+    size_t unpinned = 0;
+    for (size_t i = 0; i < cc->len; i++)
+      unpinned += !cc->dirs[i]->pinned;
+    if (unpinned >= COMPLETION_DIRS) {
+      size_t i = 0;
+      while (cc->dirs[i]->pinned)
+        i++;
+      arena_free(&cc->dirs[i]->arena);
+      free(cc->dirs[i]->names.items);
+      free(cc->dirs[i]);
+      memmove(cc->dirs + i, cc->dirs + i + 1, (cc->len - i - 1) * sizeof *cc->dirs);
+      cc->len--;
+    }
+    if (cc->len == cc->cap) {
+      size_t cap = cc->cap ? 2 * cc->cap : 16;
+      struct dir_listing **dirs = realloc(cc->dirs, cap * sizeof *dirs);
+      if (dirs == NULL)
+        return NULL;
+      cc->dirs = dirs;
+      cc->cap = cap;
+    }
+    l = calloc(1, sizeof *l);
+    if (l == NULL)
+      return NULL;
+    l->dev = sb.st_dev;
+    l->ino = sb.st_ino;
+    cc->dirs[cc->len++] = l;
+  }
+
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  char *dirents = fd != -1 ? malloc(GLOB_DIRENT_BUFFER) : NULL;
+  if (dirents == NULL) {
+    if (fd != -1)
+      close(fd);
+    return NULL;
+  }
+  arena_reset(&l->arena);
+  l->names.len = 0;
+  long got;
+  while ((got = syscall(SYS_getdents64, fd, dirents, GLOB_DIRENT_BUFFER)) > 0) {
+    for (long off = 0; off < got;) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(dirents + off);
+      off += d->d_reclen;
+      char const *name = d->d_name;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+
+      // d_type is enough for a path, only commands need the mode of each file
+      unsigned char kind = d->d_type == DT_DIR ? LISTING_DIR : 0;
+      struct stat fsb;
+      bool need_stat = d->d_type == DT_LNK || d->d_type == DT_UNKNOWN || (executables && d->d_type == DT_REG);
+      if (need_stat && fstatat(fd, name, &fsb, 0) == 0) {
+        if (S_ISDIR(fsb.st_mode))
+          kind = LISTING_DIR;
+        else if (S_ISREG(fsb.st_mode) && (fsb.st_mode & 0111))
+          kind = LISTING_EXEC;
+      }
+      size_t len = strlen(name);
+      char *copy = arena_alloc(&l->arena, len + 2);
+      if (copy == NULL || !ptr_vec_push(&l->names, copy + 1))
+        break;
+      copy[0] = kind;
+      memcpy(copy + 1, name, len + 1);
+    }
+  }
+  free(dirents);
+  close(fd);
+
+  sort_strings(l->names.items, l->names.len, 0);
+  l->mtime = sb.st_mtim;
+  l->executables = executables;
+  l->generation++;
+  return l;
+}
+
+
+// The executables on PATH, sorted and without repeats. Merged again only
+// when PATH or one of its directories changed.
+struct ptr_vec *completion_commands(struct completion_cache *cc) {
+
+  char const *path_env = var_get(&env.vars, "PATH");
+  if (path_env == NULL)
+    path_env = "/usr/local/bin:/usr/bin:/bin";
+  if (cc->path_env == NULL || strcmp(cc->path_env, path_env) != 0) {
+    for (size_t i = 0; i < cc->len; i++)
+      cc->dirs[i]->pinned = false;
+    free(cc->path_env);
+    cc->path_env = strdup(path_env);
+    cc->stamp = 0;
+    if (cc->path_env == NULL)
+      return NULL;
+  }
+
+  // Every directory is looked at, the stamp tells whether any was read again
+  struct dir_listing *dirs[256];
+  size_t num_dirs = 0;
+  uint64_t stamp = 14695981039346656037ULL;
+  for (char const *dir = cc->path_env; num_dirs < sizeof dirs / sizeof dirs[0];) {
+    char const *end = strchr(dir, ':');
+    size_t len = end ? (size_t)(end - dir) : strlen(dir);
+    char *name = strndup(dir, len);
+    struct dir_listing *l = name ? listing_read(cc, name, true) : NULL;
+    free(name);
+    if (l != NULL) {
+      l->pinned = true;
+      dirs[num_dirs++] = l;
+      stamp = (stamp ^ (uintptr_t)l ^ l->generation) * 1099511628211ULL;
+    }
+    if (end == NULL)
+      break;
+    dir = end + 1;
+  }
+  if (stamp == cc->stamp)
+    return &cc->commands;
+
+  cc->commands.len = 0;
+  for (size_t i = 0; i < num_dirs; i++) {
+    for (size_t j = 0; j < dirs[i]->names.len; j++) {
+      char *name = dirs[i]->names.items[j];
+      if (name[-1] == LISTING_EXEC && !ptr_vec_push(&cc->commands, name))
+        return NULL;
+    }
+  }
+  sort_strings(cc->commands.items, cc->commands.len, 0);
+  size_t n = 0;
+  for (size_t i = 0; i < cc->commands.len; i++) {
+    if (n == 0 || strcmp(cc->commands.items[n - 1], cc->commands.items[i]) != 0)
+      cc->commands.items[n++] = cc->commands.items[i];
+  }
+  cc->commands.len = n;
+  cc->stamp = stamp;
+  return &cc->commands;
+}
+
+
+// Adds the names of sorted that start with prefix to out
+static bool completion_range(struct ptr_vec const *sorted, char const *prefix, size_t prefix_len,
+                             struct ptr_vec *out) {
+  size_t lo = 0;
+  size_t hi = sorted->len;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (strncmp(sorted->items[mid], prefix, prefix_len) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (; lo < sorted->len && strncmp(sorted->items[lo], prefix, prefix_len) == 0; lo++) {
+    if (prefix_len == 0 && sorted->items[lo][0] == '.')
+      continue;
+    if (!ptr_vec_push(out, sorted->items[lo]))
+      return false;
+  }
+  return true;
+}
+
+
+// Inserts text at the cursor of the line editor
+static void edit_insert(struct line_editor *ed, char const *text, size_t len) {
+  if (!edit_reserve(ed, ed->len + len))
+    return;
+  char *line = ed->in->line;
+  memmove(line + ed->pos + len, line + ed->pos, ed->len - ed->pos);
+  memcpy(line + ed->pos, text, len);
+  ed->pos += len;
+  ed->len += len;
+}
+
+
+// Prints the choices in columns under the line
+static void completion_list(struct ptr_vec const *matches) {
+  struct winsize ws;
+  size_t cols = ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+  size_t shown = matches->len < 500 ? matches->len : 500;
+  size_t width = 1;
+  for (size_t i = 0; i < shown; i++) {
+    size_t len = strlen(matches->items[i]);
+    if (len + 2 > width)
+      width = len + 2;
+  }
+  size_t per_row = cols / width ? cols / width : 1;
+  size_t rows = (shown + per_row - 1) / per_row;
+  fputc('\n', stderr);
+  for (size_t r = 0; r < rows; r++) {
+    for (size_t c = 0; c < per_row && c * rows + r < shown; c++)
+      fprintf(stderr, "%-*s", (int)width, matches->items[c * rows + r]);
+    fputc('\n', stderr);
+  }
+  if (shown < matches->len)
+    fprintf(stderr, "(%zu more)\n", matches->len - shown);
+}
+
+
+// Tab: completes the word before the cursor to a command when it is the
+// first of a command, else to a path. A word that fits several is taken as
+// far as they agree and a second Tab lists them.
+void edit_complete(struct line_editor *ed) {
+
+  static char const separators[] = " \t;|&<>()";
+  char *line = ed->in->line;
+  size_t start = ed->pos;
+  while (start > 0 && strchr(separators, line[start - 1]) == NULL)
+    start--;
+  size_t word_len = ed->pos - start;
+  char *word = strndup(line + start, word_len);
+  if (word == NULL)
+    return;
+
+  // Commands come first on the line, after an operator or a keyword
+  size_t before = start;
+  while (before > 0 && (line[before - 1] == ' ' || line[before - 1] == '\t'))
+    before--;
+  size_t prev = before;
+  while (prev > 0 && strchr(separators, line[prev - 1]) == NULL)
+    prev--;
+  static char const *const keywords[] = {"if", "then", "else", "elif", "do", "while", "until", "time", "!"};
+  bool command = before == 0 || strchr(";|&(", line[before - 1]) != NULL;
+  for (size_t i = 0; !command && i < sizeof keywords / sizeof keywords[0]; i++)
+    command = before - prev == strlen(keywords[i]) && memcmp(line + prev, keywords[i], before - prev) == 0;
+  command &= strchr(word, '/') == NULL;
+
+  struct ptr_vec matches = {0};
+  char const *base = word;
+  bool ok = true;
+  if (command) {
+    struct ptr_vec *commands = completion_commands(&completions);
+    ok = commands != NULL && completion_range(commands, word, word_len, &matches);
+    for (size_t i = 0; ok && i < sizeof builtins / sizeof builtins[0]; i++) {
+      if (strncmp(builtins[i].name, word, word_len) == 0)
+        ok = ptr_vec_push(&matches, (char *)builtins[i].name);
+    }
+    for (struct function *fn = functions; ok && fn; fn = fn->next) {
+      if (!fn->defunct && strncmp(fn->name, word, word_len) == 0)
+        ok = ptr_vec_push(&matches, fn->name);
+    }
+  }
+  else {
+    // "dir/base" lists dir, a leading "~/" is $HOME
+    char *slash = strrchr(word, '/');
+    base = slash ? slash + 1 : word;
+    char *dir = slash ? strndup(word, slash - word + 1) : strdup("");
+    char const *home = var_get(&env.vars, "HOME");
+    if (dir && dir[0] == '~' && dir[1] == '/' && home) {
+      char *expanded = NULL;
+      if (asprintf(&expanded, "%s%s", home, dir + 1) < 0)
+        expanded = NULL;
+      free(dir);
+      dir = expanded;
+    }
+    struct dir_listing *l = dir ? listing_read(&completions, dir, false) : NULL;
+    ok = l != NULL && completion_range(&l->names, base, strlen(base), &matches);
+    free(dir);
+  }
+
+  if (ok && matches.len > 0) {
+    sort_strings(matches.items, matches.len, 0);
+    size_t n = 0;
+    for (size_t i = 0; i < matches.len; i++) {
+      if (n == 0 || strcmp(matches.items[n - 1], matches.items[i]) != 0)
+        matches.items[n++] = matches.items[i];
+    }
+    matches.len = n;
+
+    // Sorted, so the first and last share the prefix all of them share
+    size_t base_len = strlen(base);
+    char const *first = matches.items[0];
+    char const *last = matches.items[matches.len - 1];
+    size_t common = base_len;
+    while (first[common] && first[common] == last[common])
+      common++;
+    if (matches.len == 1) {
+      edit_insert(ed, first + base_len, common - base_len);
+      bool is_dir = !command && first[-1] == LISTING_DIR;
+      edit_insert(ed, is_dir ? "/" : " ", 1);
+    }
+    else if (common > base_len)
+      edit_insert(ed, first + base_len, common - base_len);
+    else if (ed->last_key == 9)
+      completion_list(&matches);
+  }
+  free(matches.items);
+  free(word);
+}
+
+
+// FNV-1a, command and variable names are short so this is plenty
+static size_t hash_bytes(char const *str, size_t len) {
+  size_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)str[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+
+static size_t hash_string(char const *str) {
+  return hash_bytes(str, strlen(str));
+}
+
+
+// Find the slot holding name, or the free slot it would go into
+static struct path_cache_entry *path_cache_slot(struct path_cache *pc, char const *name) {
+  size_t mask = pc->capacity - 1;
+  size_t i = hash_string(name) & mask;
+  while (pc->slots[i].name != NULL && strcmp(pc->slots[i].name, name) != 0)
+    i = (i + 1) & mask;
+  return &pc->slots[i];
+}
+
+
+struct path_cache_entry *path_cache_lookup(struct path_cache *pc, char const *name) {
+
+  // Everything cached was resolved against the old PATH, drop it if PATH changed
+  char const *path_env = var_get(&env.vars, "PATH");
+  if (path_env == NULL)
+    path_env = "/usr/local/bin:/usr/bin:/bin";
+  if (pc->path_env == NULL || strcmp(pc->path_env, path_env) != 0) {
+    path_cache_clear(pc);
+    free(pc->path_env);
+    pc->path_env = strdup(path_env);
+  }
+
+  if (pc->capacity == 0) {
+    pc->slots = calloc(64, sizeof *pc->slots);
+    if (pc->slots == NULL) {
+      perror("Error allocating the command path cache");
+      return NULL;
+    }
+    pc->capacity = 64;
+  }
+
+  struct path_cache_entry *entry = path_cache_slot(pc, name);
+  if (entry->name != NULL)
+    return entry;
+
+  char *path = resolve_command_path(name, pc->path_env);
+  if (path == NULL)
+    return NULL;
+
+  // Keep the load factor under one half so probe sequences stay short
+  if ((pc->count + 1) * 2 > pc->capacity) {
+    struct path_cache_entry *old_slots = pc->slots;
+    size_t old_capacity = pc->capacity;
+    struct path_cache_entry *slots = calloc(old_capacity * 2, sizeof *slots);
+
+    if (slots != NULL) {
+      pc->capacity *= 2;
+      pc->slots = slots;
+      for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i].name)
+          *path_cache_slot(pc, old_slots[i].name) = old_slots[i];
+      }
+      free(old_slots);
+      entry = path_cache_slot(pc, name);
+    }
+    // The old table still works fuller, but it needs a free slot to end probes
+    else {
+      perror("Error growing the command path cache");
+      if (pc->count + 1 >= pc->capacity) {
+        free(path);
+        return NULL;
+      }
+    }
+  }
+
+  entry->name = strdup(name);
+  entry->path = path;
+  entry->hits = 0;
+  pc->count++;
+  return entry;
+}
+
+
+void path_cache_forget(struct path_cache *pc, char const *name) {
+  if (pc->count == 0)
+    return;
+
+  struct path_cache_entry *entry = path_cache_slot(pc, name);
+  if (entry->name == NULL)
+    return;
+  free(entry->name);
+  free(entry->path);
+  entry->name = NULL;
+  pc->count--;
+
+  // Re-insert the rest of the probe run so later lookups do not stop at the hole
+  size_t mask = pc->capacity - 1;
+  size_t i = ((size_t)(entry - pc->slots) + 1) & mask;
+  while (pc->slots[i].name != NULL) {
+    struct path_cache_entry moved = pc->slots[i];
+    pc->slots[i].name = NULL;
+    *path_cache_slot(pc, moved.name) = moved;
+    i = (i + 1) & mask;
+  }
+}
+
+
+void path_cache_clear(struct path_cache *pc) {
+  for (size_t i = 0; i < pc->capacity; i++) {
+    if (pc->slots[i].name) {
+      free(pc->slots[i].name);
+      free(pc->slots[i].path);
+      pc->slots[i].name = NULL;
+    }
+  }
+  pc->count = 0;
+}
+
+
+// Walk path_env once and return the first executable regular file called name
+char *resolve_command_path(char const *name, char const *path_env) {
+  size_t name_len = strlen(name);
+  char const *dir = path_env;
+  char cwd[PATH_MAX];
+  cwd[0] = '\0';
+
+  while (true) {
+    char const *end = strchr(dir, ':');
+    size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+
+    // An empty PATH entry means the current directory and other relative
+    // entries start from it, the cache keeps them absolute so a "cd" does not
+    // change what they point at. Without a current directory they are skipped.
+    bool relative = dir_len == 0 || dir[0] != '/';
+    if (!relative || cwd[0] != '\0' || getcwd(cwd, sizeof cwd) != NULL) {
+      char *candidate = malloc((relative ? strlen(cwd) + 1 : 0) + dir_len + name_len + 2);
+      if (candidate == NULL)
+        return NULL;
+      if (!relative)
+        sprintf(candidate, "%.*s/%s", (int)dir_len, dir, name);
+      else if (dir_len == 0)
+        sprintf(candidate, "%s/%s", cwd, name);
+      else
+        sprintf(candidate, "%s/%.*s/%s", cwd, (int)dir_len, dir, name);
+
+      struct stat sb;
+      if (stat(candidate, &sb) == 0 && S_ISREG(sb.st_mode) && access(candidate, X_OK) == 0)
+        return candidate;
+      free(candidate);
+    }
+
+    if (end == NULL)
+      return NULL;
+    dir = end + 1;
+  }
+}
+
+
+// Length of the variable name at the start of str, 0 if it does not start with one
+size_t var_name_length(char const *str) {
+  if (!(isalpha((unsigned char)str[0]) || str[0] == '_'))
+    return 0;
+  size_t len = 1;
+  while (isalnum((unsigned char)str[len]) || str[len] == '_')
+    len++;
+  return len;
+}
+
+
+// Find the slot holding the name, or the free slot it would go into
+static struct var *var_slot(struct var_store *vs, char const *name, size_t name_len) {
+  size_t mask = vs->capacity - 1;
+  size_t i = hash_bytes(name, name_len) & mask;
+  while (vs->slots[i].entry != NULL &&
+         (vs->slots[i].name_len != name_len || memcmp(vs->slots[i].entry, name, name_len) != 0))
+    i = (i + 1) & mask;
+  return &vs->slots[i];
+}
+
+
+// name need not be terminated, expansion looks names up straight from the word
+struct var *var_lookup(struct var_store *vs, char const *name, size_t name_len) {
+  if (vs->count == 0)
+    return NULL;
+  struct var *v = var_slot(vs, name, name_len);
+  return v->entry ? v : NULL;
+}
+
+
+char const *var_get(struct var_store *vs, char const *name) {
+  struct var *v = var_lookup(vs, name, strlen(name));
+  return v ? v->entry + v->name_len + 1 : NULL;
+}
+
+
+// Sets or creates a variable, a new one is not exported
+bool var_set(struct var_store *vs, char const *name, size_t name_len, char const *value) {
+
+  size_t value_len = strlen(value);
+  char *entry = malloc(name_len + value_len + 2);
+  if (entry == NULL)
+    return false;
+  memcpy(entry, name, name_len);
+  entry[name_len] = '=';
+  memcpy(entry + name_len + 1, value, value_len + 1);
+
+  if (vs->capacity == 0) {
+    vs->slots = calloc(64, sizeof *vs->slots);
+    if (vs->slots == NULL) {
+      perror("Error allocating the variable table");
+      free(entry);
+      return false;
+    }
+    vs->capacity = 64;
+  }
+
+  // Keep the load factor under one half so probe sequences stay short
+  if ((vs->count + 1) * 2 > vs->capacity) {
+    struct var *old_slots = vs->slots;
+    size_t old_capacity = vs->capacity;
+    struct var *slots = calloc(old_capacity * 2, sizeof *slots);
+
+    if (slots != NULL) {
+      vs->capacity *= 2;
+      vs->slots = slots;
+      for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i].entry)
+          *var_slot(vs, old_slots[i].entry, old_slots[i].name_len) = old_slots[i];
+      }
+      free(old_slots);
+    }
+    // The old table still works fuller, but it needs a free slot to end probes
+    else {
+      perror("Error growing the variable table");
+      if (vs->count + 1 >= vs->capacity) {
+        free(entry);
+        return false;
+      }
+    }
+  }
+
+  struct var *v = var_slot(vs, name, name_len);
+  if (v->entry == NULL) {
+    v->exported = false;
+    v->name_len = name_len;
+    vs->count++;
+  }
+  else if (v->exported) {
+    vs->envp_dirty = true; // envp points at the entry freed below
+  }
+  free(v->entry);
+  v->entry = entry;
+  return true;
+}
+
+
+void var_export(struct var_store *vs, struct var *v) {
+  if (v->exported)
+    return;
+  v->exported = true;
+  vs->envp_dirty = true;
+}
+
+
+void var_unset(struct var_store *vs, char const *name) {
+
+  struct var *v = var_lookup(vs, name, strlen(name));
+  if (v == NULL)
+    return;
+  if (v->exported)
+    vs->envp_dirty = true;
+  free(v->entry);
+  v->entry = NULL;
+  vs->count--;
+
+  // Re-insert the rest of the probe run so later lookups do not stop at the hole
+  size_t mask = vs->capacity - 1;
+  size_t i = ((size_t)(v - vs->slots) + 1) & mask;
+  while (vs->slots[i].entry != NULL) {
+    struct var moved = vs->slots[i];
+    vs->slots[i].entry = NULL;
+    *var_slot(vs, moved.entry, moved.name_len) = moved;
+    i = (i + 1) & mask;
+  }
+}
+
+
+// The environment for exec, walked again only after an exported variable changed
+char **var_envp(struct var_store *vs) {
+
+  if (vs->envp != NULL && !vs->envp_dirty)
+    return vs->envp;
+
+  size_t n = 0;
+  for (size_t i = 0; i < vs->capacity; i++)
+    n += vs->slots[i].entry && vs->slots[i].exported;
+  if (n + 1 > vs->envp_cap) {
+    char **envp = realloc(vs->envp, (n + 1) * sizeof *envp);
+    if (envp == NULL) {
+      static char *empty[1] = {NULL};
+      return empty;
+    }
+    vs->envp = envp;
+    vs->envp_cap = n + 1;
+  }
+  n = 0;
+  for (size_t i = 0; i < vs->capacity; i++) {
+    if (vs->slots[i].entry && vs->slots[i].exported)
+      vs->envp[n++] = vs->slots[i].entry;
+  }
+  vs->envp[n] = NULL;
+  vs->envp_dirty = false;
+  vs->generation++;
+  return vs->envp;
+}
+
+
+void *arena_alloc(struct arena *a, size_t size) {
+
+  // Keep every allocation pointer 16-byte aligned, as data is
+  size = (size + 15) & ~(size_t)15;
+
+  struct arena_block *block = a->head;
+  if (block == NULL || block->size - block->used < size) {
+    // Start a new block, at least double the last one so a long line needs few of them
+    size_t block_size = 4096;
+    if (block && block->size * 2 > block_size)
+      block_size = block->size * 2;
+    if (size > block_size)
+      block_size = size;
+
+    struct arena_block *new_block = malloc(sizeof *new_block + block_size);
+    if (new_block == NULL)
+      return NULL;
+    new_block->next = block;
+    new_block->size = block_size;
+    new_block->used = 0;
+    a->head = block = new_block;
+  }
+
+  void *ptr = block->data + block->used;
+  block->used += size;
+  return ptr;
+}
+
+
+char *arena_strdup(struct arena *a, char const *str) {
+  size_t len = strlen(str);
+  char *copy = arena_alloc(a, len + 1);
+  if (copy)
+    memcpy(copy, str, len + 1);
+  return copy;
+}
+
+
+void arena_reset(struct arena *a) {
+  struct arena_block *block = a->head;
+  if (block == NULL)
+    return;
+
+  // A line overflowed into several blocks, swap them for one block big enough
+  // to hold all of it so the following lines reset in O(1) without mallocing
+  if (block->next) {
+    size_t total = 0;
+    for (struct arena_block *b = block; b; b = b->next)
+      total += b->size;
+    arena_free(a);
+    block = malloc(sizeof *block + total);
+    if (block == NULL)
+      return;
+    block->next = NULL;
+    block->size = total;
+    a->head = block;
+  }
+  block->used = 0;
+}
+
+
+void arena_free(struct arena *a) {
+  struct arena_block *block = a->head;
+  while (block) {
+    struct arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+  a->head = NULL;
+}
+
+
+static uint64_t event_tag(enum event_kind kind, pid_t pid) {
+  return ((uint64_t)kind << 32) | (uint32_t)pid;
+}
+
+
+void init_event_loop(struct event_loop *ev, bool watch_stdin) {
+
+  // SIGCHLD is only ever delivered through the signalfd
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  sigaddset(&sigchld, SIGUSR1); // dumps the trace
+  if (sigprocmask(SIG_BLOCK, &sigchld, &shell_sigmask) < 0) {
+    perror("sigprocmask()");
+    exit(EXIT_FAILURE);
+  }
+
+  ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+  ev->sigfd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (ev->epfd == -1 || ev->sigfd == -1) {
+    perror("Error setting up the event loop");
+    exit(EXIT_FAILURE);
+  }
+
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.u64 = event_tag(EVENT_SIGCHLD, 0);
+  epoll_ctl(ev->epfd, EPOLL_CTL_ADD, ev->sigfd, &event);
+
+  if (watch_stdin) {
+    event.data.u64 = event_tag(EVENT_STDIN, 0);
+    epoll_ctl(ev->epfd, EPOLL_CTL_ADD, STDIN_FILENO, &event);
+  }
+}
+
+
+void watch_child(struct event_loop *ev, pid_t pid) {
+
+  for (size_t i = 0; i < ev->len; i++) {
+    if (ev->children[i].pid == pid)
+      return;
+  }
+
+  // Without pidfds (older kernels) the signalfd alone still catches the child
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd == -1)
+    return;
+  fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+
+  if (ev->len == ev->cap) {
+    size_t cap = ev->cap ? ev->cap * 2 : 16;
+    struct watched_child *children = realloc(ev->children, cap * sizeof *children);
+    if (children == NULL) {
+      close(pidfd);
+      return;
+    }
+    ev->children = children;
+    ev->cap = cap;
+  }
+
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.u64 = event_tag(EVENT_PIDFD, pid);
+  if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, pidfd, &event) < 0) {
+    close(pidfd);
+    return;
+  }
+  ev->children[ev->len].pid = pid;
+  ev->children[ev->len].pidfd = pidfd;
+  ev->len++;
+}
+
+
+void unwatch_child(struct event_loop *ev, pid_t pid) {
+  for (size_t i = 0; i < ev->len; i++) {
+    if (ev->children[i].pid == pid) {
+      // Closing the pidfd also drops it from the epoll set
+      close(ev->children[i].pidfd);
+      ev->children[i] = ev->children[--ev->len];
+      return;
+    }
+  }
+}
+
+
+// Starts reading a "set -o mux=1" pipe, fd -1 is ignored
+void mux_watch(struct event_loop *ev, int fd, int target, int job_id, pid_t pid) {
+
+  if (fd == -1)
+    return;
+  struct mux_stream *s = malloc(sizeof *s);
+  if (s != NULL && ev->num_streams == ev->streams_cap) {
+    size_t cap = ev->streams_cap ? ev->streams_cap * 2 : 16;
+    struct mux_stream **streams = realloc(ev->streams, cap * sizeof *streams);
+    if (streams == NULL) {
+      free(s);
+      s = NULL;
+    }
+    else {
+      ev->streams = streams;
+      ev->streams_cap = cap;
+    }
+  }
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.u64 = event_tag(EVENT_MUX, fd);
+  if (s == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) < 0 || epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    perror("Error watching the job output");
+    free(s);
+    close(fd);
+    return;
+  }
+  s->fd = fd;
+  s->target = target;
+  s->job_id = job_id;
+  s->pid = pid;
+  s->len = 0;
+  ev->streams[ev->num_streams++] = s;
+}
+
+
+// writev() of all of iov, however little the terminal takes at a time
+static void write_iov(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t wrote = writev(fd, iov, count);
+    if (wrote < 0 && errno == EINTR)
+      continue;
+    if (wrote < 0)
+      return;
+    for (; count > 0 && (size_t)wrote >= iov->iov_len; iov++, count--)
+      wrote -= iov->iov_len;
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + wrote;
+      iov->iov_len -= wrote;
+    }
+  }
+}
+
+
+// Writes out the whole lines in the buffer, each after the job's tag, as few
+// writev() calls as the lines fit in. At eof, or when a line fills the whole
+// buffer, the rest goes out too with a newline added.
+static void mux_emit(struct mux_stream *s, bool eof) {
+
+  char tag[48];
+  int tag_len = snprintf(tag, sizeof tag, "[%d %jd] ", s->job_id, (intmax_t)s->pid);
+  struct iovec iov[MUX_IOV];
+  int count = 0;
+  char *p = s->buf;
+  char *end = s->buf + s->len;
+  while (p < end) {
+    char *newline = memchr(p, '\n', end - p);
+    if (newline == NULL && !eof && !(p == s->buf && s->len == MUX_BUFFER))
+      break;
+    char *line_end = newline ? newline + 1 : end;
+    iov[count++] = (struct iovec){tag, tag_len};
+    iov[count++] = (struct iovec){p, line_end - p};
+    if (newline == NULL)
+      iov[count++] = (struct iovec){"\n", 1};
+    p = line_end;
+    if (count > MUX_IOV - 3) {
+      write_iov(s->target, iov, count);
+      count = 0;
+    }
+  }
+  write_iov(s->target, iov, count);
+  s->len = end - p;
+  memmove(s->buf, p, s->len);
+}
+
+
+// Reads what the job wrote since the last time. Returns the bytes read, 0
+// when there was nothing and -1 once the stream went away at eof.
+static ssize_t mux_read(struct event_loop *ev, size_t index) {
+
+  struct mux_stream *s = ev->streams[index];
+  ssize_t got;
+  while ((got = read(s->fd, s->buf + s->len, MUX_BUFFER - s->len)) < 0 && errno == EINTR)
+    ;
+  if (got < 0 && errno == EAGAIN)
+    return 0;
+  if (got > 0) {
+    s->len += got;
+    mux_emit(s, false);
+    ev->reported = true;
+    return got;
+  }
+  if (s->len > 0) {
+    mux_emit(s, true);
+    ev->reported = true;
+  }
+  close(s->fd);
+  free(s);
+  ev->streams[index] = ev->streams[--ev->num_streams];
+  return -1;
+}
+
 
-    // Split user input into an array for variable expansion and parsing
-    char *token = NULL;
-    unsigned int index = 0;
-    // use strtok to split the line
-    if (env.ifs == NULL) {
-      token = strtok(line, " \t\n");
-      while (token != NULL) {
-        split_words[index] = strdup(token);
-        index++;
-        token = strtok(NULL, " \t\n");
-      }
-    }
-    else {
-      token = strtok(line, env.ifs);
-      while (token != NULL) {
-        split_words[index] = strdup(token);
-        index++;
-        token = strtok(NULL, env.ifs);
-      }
-    }
+// Reads what is in every pipe now, so what a job wrote before it exited is
+// out before "wait" returns or the shell exits. Jobs still writing do not
+// keep it here.
+void mux_drain(struct event_loop *ev) {
+  for (size_t i = 0; i < ev->num_streams;) {
+    int available = 0;
+    ioctl(ev->streams[i]->fd, FIONREAD, &available);
+    ssize_t got;
+    do
+      got = mux_read(ev, i);
+    while (got > 0 && (available -= got) > 0);
+    if (got > 0)
+      got = mux_read(ev, i); // the eof after the data
+    if (got >= 0)
+      i++;
+  }
+}
 
-    // Expand any variables in the user input 
-    expand_variables(split_words, index, &env);
-    
-    // Parse the user input into the pt struct
-    if (parse_input(split_words, index, &pt) < 0) {
-      perror("Error with parss_input()");
-      for (int i = 0; i < index; i++)
-        free(split_words[i]);
-      goto exit;
-    }
 
-    // Restart the loop if user input is empty
-    if (pt.cmd == NULL)
-      goto start;
-   
-    // Check for exit or cd built in commands 
-    if (strcmp(pt.cmd, "exit") == 0) {
-      execute_exit_command(&env, &pt);
-      goto exit;
-    }
-    if (strcmp(pt.cmd, "cd") == 0) {
-      execute_cd_command(&env, &pt);
-      goto start;
-    }
+// Waits up to timeout ms (-1 forever) and handles what arrived. Returns 1 when
+// stdin is readable, 0 otherwise and -1 if a signal interrupted the wait.
+int service_events(struct event_loop *ev, struct env_vars *env, int timeout) {
+
+  struct epoll_event events[32];
+  int count = epoll_wait(ev->epfd, events, 32, timeout);
+  if (count < 0)
+    return errno == EINTR ? -1 : 0;
 
-    // Fork a child process to execvp the non built in command
-	  pid_t spawnpid = -5;
-	  int childStatus = -5;
-	  pid_t childPid = -5;
-    int targetFD = -5;
-    int sourceFD = -5;
-
-    spawnpid = fork(); // If fork is successful, the value of spawnpid will be 0 in the child, the child's pid in the parent
-	  switch (spawnpid){
-	  case -1:
-		  perror("fork()");
-		  exit(EXIT_FAILURE);
-	  case 0:
-      // This is the child process
-      if (pt.will_run_in_bg) {
-        // Find and remove '&' from the command args
-        for (int i = 0; i < MAX_INPUT; i++) {
-          if (*pt.input_for_execvp[i] == '&' && !pt.input_for_execvp[i + 1]) {
-            pt.input_for_execvp[i] = NULL;
+  int stdin_ready = 0;
+  for (int i = 0; i < count; i++) {
+    enum event_kind kind = events[i].data.u64 >> 32;
+    pid_t pid = (pid_t)(uint32_t)events[i].data.u64;
+    int status;
+    struct rusage ru;
+
+    switch (kind) {
+      case EVENT_STDIN:
+        stdin_ready = 1;
+        break;
+      case EVENT_MUX:
+        for (size_t j = 0; j < ev->num_streams; j++) {
+          if (ev->streams[j]->fd == pid) {
+            mux_read(ev, j);
             break;
           }
         }
+        break;
+      case EVENT_PIDFD:
+        // This child exited, reap just it
+        if (wait4(pid, &status, WNOHANG, &ru) == pid)
+          handle_child_status(ev, env, pid, status, &ru);
+        break;
+      case EVENT_SIGCHLD: {
+        // Signals coalesce, so drain the fd and then reap everything that changed state,
+        // including stopped children which a pidfd never reports
+        struct signalfd_siginfo info;
+        bool dump = false;
+        while (read(ev->sigfd, &info, sizeof info) == sizeof info)
+          dump |= info.ssi_signo == SIGUSR1;
+        if (dump)
+          dump_trace();
+        while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &ru)) > 0)
+          handle_child_status(ev, env, pid, status, &ru);
+        break;
       }
+    }
+  }
+  return stdin_ready;
+}
 
-      // Handle output redirection
-      if (pt.output_redirection_path) {
-        close(1);
 
-        // Open the target FD, will get 1 since we just closed 1 (stdout)
-        targetFD = -1;
-        if ((targetFD = open(pt.output_redirection_path, O_WRONLY | O_CREAT | O_APPEND, 0777) == -1)) {
-          perror("Output open()");
-          exit(EXIT_SUCCESS);
-        }
-      }
+// Blocks until stdin has input, reporting children as they finish. While
+// nothing happens the history index is built a slice at a time.
+// Returns -1 with errno EINTR when CTRL-C interrupted the wait.
+int wait_for_input(struct event_loop *ev, struct env_vars *env) {
+  while (true) {
+    ev->reported = false;
+    bool idle_work = history.indexed < history.len && !history.index_failed;
+    int ready = service_events(ev, env, idle_work ? 0 : -1);
+    if (ready < 0) {
+      errno = EINTR;
+      return -1;
+    }
+    if (ready > 0)
+      return 0;
+    // A completion message was printed over the prompt, show it again
+    if (ev->reported) {
+      if (editor.active)
+        edit_refresh(&editor);
+      else
+        fputs(editor.prompt, stderr);
+    }
+    else if (idle_work) {
+      edit_sync_history(&editor);
+      history_index(&history, 256 * 1024);
+    }
+  }
+}
 
-      // Handle input redirection
-      if (pt.input_redirection_path) {
-	      close(0);
 
-        // Open source file, will get 0 as the FD since we just closed 0 (stdout)
-	      sourceFD = open(pt.input_redirection_path, O_RDONLY);
-	      if (sourceFD == -1) { 
-		      perror("Source open()"); 
-	  	    exit(EXIT_FAILURE); 
-        }
-      }
+// Waits for the foreground child while background ones keep being reaped.
+// Returns false when the child stopped and was moved to the background.
+bool wait_foreground(struct event_loop *ev, struct env_vars *env, pid_t *pids, size_t count, pid_t pgid,
+                     struct parsed_tokens *pt, int *status) {
 
-      if (execvp(pt.input_for_execvp[0], pt.input_for_execvp) == -1) {
-        perror("Error executing that command.");
-        exit(EXIT_FAILURE);
-      }
-      
-      // Close the targetFD and sourceFD
-      if (targetFD >= 0) {
-        if (close(targetFD) == -1) {
-          perror("close(targetFD)");
-          exit(EXIT_FAILURE);
-        }
-      }
-      if (sourceFD >= 0) {
-        if (close(sourceFD) == -1) {
-          perror("close(sourceFD)");
-          exit(EXIT_FAILURE);
-        }
-      }
-      goto exit;
-      break;
+  ev->fg_pids = pids;
+  ev->fg_count = count;
+  ev->fg_live = 0;
+  ev->fg_last = pids[count - 1];
+  ev->fg_status = *status;
+  ev->fg_done = false;
+  ev->fg_stopped = false;
+  ev->fg_pt = pt;
+  memset(&ev->fg_usage, 0, sizeof ev->fg_usage);
+  for (size_t i = 0; i < count; i++) {
+    if (pids[i]) {
+      if (pgid == 0)
+        pgid = pids[i];
+      ev->fg_live++;
+      watch_child(ev, pids[i]);
+    }
+  }
 
-	default:
-    // This is the parent process
+  // The job's process group owns the terminal until it is done
+  if (job_control)
+    tcsetpgrp(STDIN_FILENO, pgid);
 
-    if (pt.will_run_in_bg) {
+  while (ev->fg_live > 0 && !ev->fg_done)
+    service_events(ev, env, -1);
 
-      // Find and remove the '&' from the args input for execvp()
-      for (int i = 0; i < MAX_INPUT; i++) {
-        if (pt.input_for_execvp[i] == NULL)
-          break;
+  if (job_control)
+    tcsetpgrp(STDIN_FILENO, getpgrp());
 
-        if (strcmp(pt.input_for_execvp[i], "&") == 0) {
-          pt.input_for_execvp[i] = NULL;
-          break;
-        }
-      }
+  ev->fg_pids = NULL;
+  ev->fg_count = 0;
+  ev->fg_pt = NULL;
+  *status = ev->fg_status;
+  return !ev->fg_stopped;
+}
 
-      // Update $! to be the PID of the background process
-      free(env.last_bg_exec_return_val);
-      env.last_bg_exec_return_val = NULL;
 
-      char *tmp_str = (char *)malloc(sizeof(char) * 8);
-      sprintf(tmp_str, "%d", spawnpid);
-      
-      env.last_bg_exec_return_val = strdup(tmp_str);
-      free(tmp_str);
-      
-      childPid = waitpid(spawnpid, &childStatus, WNOHANG); // non-blocking wait
+// Index of pid among the foreground stages, -1 if it is not one of them
+static ssize_t foreground_stage(struct event_loop *ev, pid_t pid) {
+  for (size_t i = 0; i < ev->fg_count; i++) {
+    if (ev->fg_pids[i] == pid)
+      return i;
+  }
+  return -1;
+}
+
+
+void handle_child_status(struct event_loop *ev, struct env_vars *env, pid_t pid, int status, struct rusage *ru) {
+
+  // The zygote is ours too, its death only means launching directly from now on
+  if (pid == zygote.pid) {
+    if (WIFSTOPPED(status)) {
+      kill(pid, SIGCONT);
+      return;
     }
-    else {
-      childPid = waitpid(spawnpid, &childStatus, 0); // blocking wait
-      
-      // Check whether the child process exited or was signaled
-      if (WIFEXITED(childStatus)) {
-        // Update $?
-        free(env.last_fg_exec_return_val);
-        env.last_fg_exec_return_val = NULL;
-
-        char *tmp_str = (char *)malloc(sizeof(char) * 8);
-        sprintf(tmp_str, "%d", WEXITSTATUS(childStatus));
-        
-        env.last_fg_exec_return_val = strdup(tmp_str);
-        free(tmp_str);
+    zygote.pid = 0;
+    if (zygote.sock != -1)
+      zygote_lost();
+    return;
+  }
+
+  ssize_t stage = foreground_stage(ev, pid);
+
+  if (WIFSTOPPED(status)) {
+    // A stopped child is continued in the background
+    fprintf(stderr, "Child process %jd stopped. Continuing.\n", (intmax_t)pid);
+    kill(pid, SIGCONT);
+    update_last_bg_pid(env, pid);
+    ev->reported = true;
+    if (stage >= 0) {
+      ev->fg_done = true;
+      ev->fg_stopped = true;
+      // The rest of the pipeline keeps running in the background, so it becomes a job
+      if (job_by_pid(&job_table, pid) == NULL && ev->fg_pt) {
+        struct job *job = job_create(&job_table, ev->fg_pt);
+        if (job)
+          job_started(&job_table, job, ev->fg_pids, ev->fg_count);
       }
-      else {
-        // Update $? to 128 + [n], where [n] is the number of the signal that caused the child to terminate
-        free(env.last_fg_exec_return_val);
-        env.last_fg_exec_return_val = NULL;
+    }
+    return;
+  }
 
-        char *tmp_str = (char *)malloc(sizeof(char) * 8);
-        sprintf(tmp_str, "%d", (WTERMSIG(childStatus) + 128));
+  unwatch_child(ev, pid);
 
-        env.last_fg_exec_return_val = strdup(tmp_str);
-        free(tmp_str);
+  // Log the finished command, its argv comes from the job or the foreground pipeline
+  struct job *owner = job_by_pid(&job_table, pid);
+  if (acct_fd != -1) {
+    struct parsed_tokens *cmd = NULL;
+    ssize_t index = -1;
+    if (owner) {
+      cmd = owner->pt;
+      for (size_t i = 0; i < owner->num_pids; i++) {
+        if (owner->pids[i] == pid)
+          index = i;
       }
     }
-    break;
-	}
-    // Free strings
-    for (unsigned int i = 0; i < index; i++)
-      free(split_words[i]);
+    else if (stage >= 0 && ev->fg_pt) {
+      cmd = ev->fg_pt;
+      index = stage;
+    }
+    for (; cmd && index > 0; index--)
+      cmd = cmd->next_stage;
+    if (cmd && index == 0)
+      write_acct_record(cmd, pid, status, &(owner ? owner->pt : ev->fg_pt)->started, ru);
   }
- 
-exit:
-  if (atoi(env.smallsh_process_id) == getpid())
-    free_env_vars_struct(&env);
-  free_parsed_tokens_struct(&pt);
+  if (owner)
+    rusage_add(&owner->usage, ru);
 
-  return 0;
+  if (stage >= 0) {
+    ev->fg_pids[stage] = 0;
+    ev->fg_live--;
+    if (pid == ev->fg_last)
+      ev->fg_status = status;
+    rusage_add(&ev->fg_usage, ru);
+  }
+  else {
+    // The job's last lines come before the word that it is done
+    mux_drain(ev);
+    if (WIFEXITED(status))
+      fprintf(stderr, "Child process %jd done. Exit status %d\n", (intmax_t)pid, WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+      fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t)pid, WTERMSIG(status));
+    ev->reported = true;
+  }
+
+  // A finished job frees its slot for the next queued one
+  struct job *job = job_child_done(&job_table, pid, status);
+  if (job) {
+    if (job->pt->timed)
+      print_time_report(&job->pt->started, &job->usage);
+    job_remove(&job_table, job, job->status);
+    schedule_jobs(&job_table, ev, env);
+  }
 }
 
 
-void execute_cd_command(struct env_vars *env, struct parsed_tokens *pt) {
+// Copies the command with all its strings into a, so it outlives the line
+struct parsed_tokens *copy_parsed_tokens(struct parsed_tokens const *src, struct arena *a) {
 
-  if (pt->cmd_args[0] == NULL) {
-    if (chdir(env->home_path) != 0) {
-      perror("Error, unable to CD to the home directory!");
+  struct parsed_tokens *dst = arena_alloc(a, sizeof *dst);
+  size_t argc = 0;
+  while (src->input_for_execvp[argc])
+    argc++;
+
+  char **argv = arena_alloc(a, (argc + 1) * sizeof *argv);
+  if (dst == NULL || argv == NULL)
+    return NULL;
+  for (size_t i = 0; i < argc; i++)
+    argv[i] = arena_strdup(a, src->input_for_execvp[i]);
+  argv[argc] = NULL;
+
+  *dst = *src;
+  dst->input_for_execvp = argv;
+  dst->cmd = argv[0];
+  dst->cmd_args = argv + 1;
+  if (src->num_redirs > 0) {
+    dst->redirs = arena_alloc(a, src->num_redirs * sizeof *dst->redirs);
+    if (dst->redirs == NULL)
+      return NULL;
+    for (size_t i = 0; i < src->num_redirs; i++) {
+      dst->redirs[i] = src->redirs[i];
+      if (src->redirs[i].path)
+        dst->redirs[i].path = arena_strdup(a, src->redirs[i].path);
     }
   }
-  else {
-    if (chdir(pt->cmd_args[0]) < 0) {
-      perror("Error, unable to CD to that directory!\n");
-    }
+  if (src->input_data)
+    dst->input_data = arena_strdup(a, src->input_data);
+  if (src->placement) {
+    dst->placement = arena_alloc(a, sizeof *dst->placement);
+    if (dst->placement == NULL)
+      return NULL;
+    *dst->placement = *src->placement;
+    if (src->placement->cgroup)
+      dst->placement->cgroup = arena_strdup(a, src->placement->cgroup);
+  }
+
+  // The rest of the pipeline comes along
+  if (src->next_stage) {
+    dst->next_stage = copy_parsed_tokens(src->next_stage, a);
+    if (dst->next_stage == NULL)
+      return NULL;
   }
+  return dst;
 }
 
 
-void execute_exit_command(struct env_vars *env, struct parsed_tokens *pt) {
- 
+// Takes the lowest free job number and records a copy of the command
+struct job *job_create(struct job_table *jt, struct parsed_tokens *pt) {
 
-  if (pt->cmd_args[0] != NULL) { // an argument was provided
+  size_t slot = 0;
+  while (slot < jt->id_cap && jt->by_id[slot] != NULL)
+    slot++;
+  if (slot == jt->id_cap) {
+    size_t cap = jt->id_cap ? jt->id_cap * 2 : 16;
+    struct job **by_id = realloc(jt->by_id, cap * sizeof *by_id);
+    if (by_id == NULL)
+      return NULL;
+    memset(by_id + jt->id_cap, 0, (cap - jt->id_cap) * sizeof *by_id);
+    jt->by_id = by_id;
+    jt->id_cap = cap;
+  }
 
-    // if the argument is not an integer, it is an error, or if more than 1 arguments are supplied, it is an error
-    if (pt->cmd_args[1] != NULL) {
-      perror("Error, too many arguments for exit command provided");
-      exit(2);
-    }
-    if (isdigit(*pt->cmd_args[0]) == 0) {
-      perror("Error, argument for exit command is not an integer");
-      exit(2);
-    }
+  struct job *job = calloc(1, sizeof *job);
+  if (job == NULL)
+    return NULL;
+  job->id = slot + 1;
+  job->state = JOB_QUEUED;
+  job->pt = copy_parsed_tokens(pt, &job->arena);
 
-    // send SIGINT through kill() to all child processes
-    if (kill(0, SIGINT) < 0) {
-      perror("Error with kill()");
-      exit(2);
-    }
-    
-    
-    // free stuff first
-    int tmp = atoi(pt->cmd_args[0]);
-    free(env->last_fg_exec_return_val);
-    char *tmp_str = (char *)malloc(sizeof(char) * 6);
-    sprintf(tmp_str, "%d", tmp);
-    env->last_fg_exec_return_val = tmp_str;
-    
-    fprintf(stderr, "\nexit\n");
-    exit(tmp);
+  // The command line as typed, for jobs and fg
+  size_t len = 1;
+  for (struct parsed_tokens *stage = pt; stage; stage = stage->next_stage) {
+    for (int i = 0; stage->input_for_execvp[i]; i++)
+      len += strlen(stage->input_for_execvp[i]) + 1;
+    for (size_t i = 0; i < stage->num_redirs; i++)
+      len += (stage->redirs[i].path ? strlen(stage->redirs[i].path) : 0) + 32;
+    len += 3;
   }
-  else {
-    // send SIGINT through kill() to all child processes
-    if (kill(0, SIGINT) < 0) {
-      perror("Error with kill()\n");
-      exit(2);
+  job->command = arena_alloc(&job->arena, len);
+  if (job->pt == NULL || job->command == NULL) {
+    arena_free(&job->arena);
+    free(job);
+    return NULL;
+  }
+  char *p = job->command;
+  for (struct parsed_tokens *stage = pt; stage; stage = stage->next_stage) {
+    if (stage != pt)
+      p += sprintf(p, " | ");
+    for (int i = 0; stage->input_for_execvp[i]; i++)
+      p += sprintf(p, "%s%s", i ? " " : "", stage->input_for_execvp[i]);
+    for (size_t i = 0; i < stage->num_redirs; i++) {
+      *p++ = ' ';
+      p += format_redirection(p, &stage->redirs[i]);
+      if (stage->redirs[i].path)
+        p += sprintf(p, " %s", stage->redirs[i].path);
     }
+  }
 
-    int tmp = atoi(env->last_fg_exec_return_val);
-    fprintf(stderr, "\nexit\n");
-    exit(tmp);
+  jt->by_id[slot] = job;
+  jt->count++;
+  jt->current_id = job->id;
+  return job;
+}
+
+
+static size_t pid_slot(struct job_table *jt, pid_t pid) {
+  size_t mask = jt->pid_cap - 1;
+  size_t i = ((size_t)pid * 2654435761u) & mask;
+  while (jt->by_pid[i].job != NULL && jt->by_pid[i].pid != pid)
+    i = (i + 1) & mask;
+  return i;
+}
+
+
+// Takes pid out of the pid map, re-inserting the rest of its probe run. A pid
+// the map had no room for is only counted.
+static void pid_map_remove(struct job_table *jt, pid_t pid) {
+  size_t mask = jt->pid_cap - 1;
+  size_t i = jt->pid_count ? pid_slot(jt, pid) : 0;
+  if (jt->pid_count == 0 || jt->by_pid[i].job == NULL) {
+    if (jt->unmapped > 0)
+      jt->unmapped--;
+    return;
   }
-};
+  jt->by_pid[i].job = NULL;
+  jt->pid_count--;
+  for (i = (i + 1) & mask; jt->by_pid[i].job != NULL; i = (i + 1) & mask) {
+    struct job_pid moved = jt->by_pid[i];
+    jt->by_pid[i].job = NULL;
+    jt->by_pid[pid_slot(jt, moved.pid)] = moved;
+  }
+}
 
 
-int parse_input(char **words, unsigned int num_words, struct parsed_tokens *pt) {
+// Marks the job as running with one pid per stage (0 for stages that did not
+// start), it now holds a slot
+void job_started(struct job_table *jt, struct job *job, pid_t *pids, size_t count) {
 
-  unsigned int num_words_before_comments = num_words;
-  
-  for (int i = 0; i < num_words; i++) {
-    if (strcmp(words[i], "#") == 0) {
-      num_words_before_comments = i;
+  // Keep the pid map under half full
+  while ((jt->pid_count + count) * 2 > jt->pid_cap) {
+    struct job_pid *old = jt->by_pid;
+    size_t old_cap = jt->pid_cap;
+    struct job_pid *by_pid = calloc(old_cap ? old_cap * 2 : 64, sizeof *by_pid);
+    if (by_pid == NULL) {
+      perror("Error growing the job pid map");
       break;
     }
+    jt->pid_cap = old_cap ? old_cap * 2 : 64;
+    jt->by_pid = by_pid;
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].job)
+        jt->by_pid[pid_slot(jt, old[i].pid)] = old[i];
+    }
+    free(old);
   }
- 
-  if (num_words_before_comments < num_words)
-    num_words = num_words_before_comments;
 
-  // Check if the last word is an "&" and set run in background to True
-  if (num_words > 0) {
-    if (strcmp(words[num_words - 1], "&") == 0) {
-      pt->will_run_in_bg = true;
+  job->pids = arena_alloc(&job->arena, count * sizeof *job->pids);
+  job->num_pids = count;
+  job->live = 0;
+  job->pgid = 0;
+  for (size_t i = 0; i < count; i++) {
+    job->pids[i] = pids[i];
+    if (pids[i] == 0)
+      continue;
+    if (job->pgid == 0)
+      job->pgid = pids[i];
+    job->live++;
+    // Without room in the map job_by_pid() scans the table for it
+    if (jt->pid_count + 1 >= jt->pid_cap) {
+      jt->unmapped++;
+      continue;
     }
+    size_t slot = pid_slot(jt, pids[i]);
+    jt->by_pid[slot].pid = pids[i];
+    jt->by_pid[slot].job = job;
+    jt->pid_count++;
   }
+  // A last stage that never started counts as having exited with 1
+  if (pids[count - 1] == 0)
+    job->status = 1 << 8;
+  job->state = JOB_RUNNING;
+  jt->running++;
+}
 
-  // Set cmd and cmd_args accordingly
-  switch (num_words) {    
-    case 0:
-      return 0;
-    case 1:
-      // Only store the command
-      pt->cmd = strdup(words[0]); // Free this!
-      break;
-    default:
-      pt->cmd = strdup(words[0]); // Free this!
-      
-      // Check that the second input is actually flags
-      int j = 1;
-      int num_args = 0;
-      while (j < num_words) {
-        if ((strcmp(words[j], "<") == 0) || (strcmp(words[j], ">") == 0)) {
-          // store num_args and break the loop by setting j to num_words
-          j = num_words;
-          
-        }
-        else {
-          num_args += 1;
-          j++;
-        }
-      }
-      for (int i = 0; i < num_args; i++) {
-        pt->cmd_args[i] = strdup(words[i + 1]); // Free this!
-        pt->input_for_execvp[i+1] = strdup(pt->cmd_args[i]);
-      }
-      break;
-  }
 
-  // Check for redirection of input/output
-  for (int i = 1; i < num_words; i++) {
+// Launches a queued job's pipeline, false when none of it could be started
+bool job_launch(struct job_table *jt, struct event_loop *ev, struct env_vars *env, struct job *job, bool foreground) {
 
-    if (strcmp(words[i], "<") == 0) {
-      if (pt->input_redirection_path != NULL) {
-        fprintf(stderr, "Error, multiple input redirection operands provided.\n");
-        return -1;
-      }
-      // set the word after "<" to be the input redirection path 
-      if ((i + 1) >= num_words) {
-        fprintf(stderr, "Error, input redirection operand < provided but no following word provided.\n");
-        return -1;
-      }
-      pt->input_redirection_path = strdup(words[i + 1]); // free this!
+  size_t count = count_stages(job->pt);
+  pid_t *pids = arena_alloc(&job->arena, count * sizeof *pids);
+  int mux_fds[2] = {-1, -1};
+  if (pids == NULL || launch_pipeline(job->pt, pids, foreground, !foreground && mux_output ? mux_fds : NULL) == 0) {
+    for (int i = 0; i < 2; i++) {
+      if (mux_fds[i] != -1)
+        close(mux_fds[i]);
     }
-    
-    if (strcmp(words[i], ">") == 0) {
-      // printf("Current word is: %s\n", words[i]);
-      // printf("Next word is: %s\n", words[i + 1]);
-
-      if (pt->output_redirection_path != NULL) {
-        fprintf(stderr, "Error, multiple output redirection operands provided.\n");
-        return -1;
-      }
-      // set the word after ">" to be the output redirection path
-      if ((i + 1) >= num_words) {
-        fprintf(stderr, "Error, output redirection operand > provided but no following word provided.\n");
-        return -1;
-      }
-      pt->output_redirection_path = strdup(words[i + 1]); // free this!
+    job_remove(jt, job, 1 << 8);
+    return false;
+  }
+  job_started(jt, job, pids, count);
+  for (size_t i = 0; i < count; i++) {
+    if (pids[i] && !foreground) {
+      watch_child(ev, pids[i]);
+      update_last_bg_pid(env, pids[i]);
     }
-
   }
-  pt->input_for_execvp[0] = strdup(pt->cmd);
-
-  return 0;
+  mux_watch(ev, mux_fds[0], STDOUT_FILENO, job->id, env->last_bg_pid);
+  mux_watch(ev, mux_fds[1], STDERR_FILENO, job->id, env->last_bg_pid);
+  return true;
 }
 
 
-void init_parsed_tokens_struct(struct parsed_tokens *pt) {
-  pt->cmd = NULL;
-  for (int i = 0; i < MAX_INPUT; i++)
-    pt->cmd_args[i] = NULL;
-  for (int i = 0; i < MAX_INPUT + 1; i++) {
-    pt->input_for_execvp[i] = NULL;
+// Records that one stage was reaped, returns its job once every stage is done
+struct job *job_child_done(struct job_table *jt, pid_t pid, int status) {
+  struct job *job = job_by_pid(jt, pid);
+  if (job == NULL)
+    return NULL;
+
+  pid_map_remove(jt, pid);
+  for (size_t i = 0; i < job->num_pids; i++) {
+    if (job->pids[i] != pid)
+      continue;
+    if (i == job->num_pids - 1)
+      job->status = status;
+    job->pids[i] = 0;
   }
-  pt->input_redirection_path = NULL;
-  pt->output_redirection_path = NULL;
-  pt->will_run_in_bg = 0;
+  job->live--;
+  return job->live == 0 ? job : NULL;
 }
 
 
-void free_parsed_tokens_struct(struct parsed_tokens *pt) {
-  if (pt->cmd)
-    free(pt->cmd);
-  for (int i = 0; i < MAX_INPUT; i++) {
-    if (pt->cmd_args[i])
-      free(pt->cmd_args[i]);
-    else
-      break;
+// Sends sig to every stage of the job still running
+void signal_job(struct job *job, int sig) {
+  if (job->state != JOB_RUNNING)
+    return;
+  if (job_control) {
+    kill(-job->pgid, sig);
+    return;
   }
-  for (int i = 0; i < MAX_INPUT + 1; i++) {
-    if (pt->input_for_execvp[i])
-      free(pt->input_for_execvp[i]);
-    else
-      break;
+  for (size_t i = 0; i < job->num_pids; i++) {
+    if (job->pids[i])
+      kill(job->pids[i], sig);
   }
-  if (pt->input_redirection_path)
-    free(pt->input_redirection_path);
-  if (pt->output_redirection_path)
-    free(pt->output_redirection_path);
 }
 
 
-void print_env_struct(struct env_vars *env) {
-  fprintf(stderr, "Homepath is: %s\n", env->home_path);
-  fprintf(stderr, "IFS is: %s\n", env->ifs);
-  fprintf(stderr, "PS1 is: %s\n", env->ps1);
-  fprintf(stderr, "Last bg exec return val is: %s\n", env->last_bg_exec_return_val);
-  fprintf(stderr, "Last fg exec return val is: %s\n", env->last_fg_exec_return_val);
-  fprintf(stderr, "SMALLSH proecess is: %s\n", env->smallsh_process_id);
+void job_enqueue(struct job_table *jt, struct job *job) {
+  job->next_queued = NULL;
+  if (jt->queue_tail)
+    jt->queue_tail->next_queued = job;
+  else
+    jt->queue_head = job;
+  jt->queue_tail = job;
 }
 
 
-void print_parsed_tokens_struct(struct parsed_tokens *pt) {
-  fprintf(stderr, "pt->cmd: %s\n", pt->cmd);
-  for (int i = 0; i < MAX_INPUT; i++) {
-    if (pt->cmd_args[i])
-      fprintf(stderr, "pt->cmd_args[%d]: %s\n", i, pt->cmd_args[i]);
+// Takes a queued job out of the FIFO without starting it
+void job_dequeue(struct job_table *jt, struct job *job) {
+  struct job *prev = NULL;
+  for (struct job *q = jt->queue_head; q; prev = q, q = q->next_queued) {
+    if (q != job)
+      continue;
+    if (prev)
+      prev->next_queued = q->next_queued;
     else
-      break;
+      jt->queue_head = q->next_queued;
+    if (jt->queue_tail == q)
+      jt->queue_tail = prev;
+    return;
   }
-  
-  for (int i = 0; i < MAX_INPUT + 1; i++) {
-    if (pt->input_for_execvp[i])
-      fprintf(stderr, "pt->input_for_execvp[%d]: %s\n", i, pt->input_for_execvp[i]);
-    else
-      break;
+}
+
+
+// Drops the job from the table, status is what the wait builtin reports for it
+void job_remove(struct job_table *jt, struct job *job, int status) {
+
+  if (job->state == JOB_RUNNING) {
+    for (size_t i = 0; i < job->num_pids; i++) {
+      if (job->pids[i])
+        pid_map_remove(jt, job->pids[i]);
+    }
+    jt->running--;
   }
-  
-  fprintf(stderr, "pt->input_redirection_path: %s\n", pt->input_redirection_path);
-  fprintf(stderr, "pt->output_redirection_path: %s\n", pt->output_redirection_path);
-  fprintf(stderr, "pt->will_run_in_bg: %d\n", pt->will_run_in_bg);
 
+  if (job->id == jt->wait_id) {
+    jt->wait_done = true;
+    jt->wait_status = status;
+  }
+  if (job->id == jt->current_id)
+    jt->current_id = 0;
+
+  jt->by_id[job->id - 1] = NULL;
+  jt->count--;
+  arena_free(&job->arena);
+  free(job);
 }
 
 
-char *str_gsub(char **haystack, char const *needle, char const *sub) {
-  char *str = *haystack;
-  size_t haystack_len = strlen(str);
-  size_t const needle_len = strlen(needle);
-  size_t const sub_len = strlen(sub);
+struct job *job_by_id(struct job_table *jt, int id) {
+  if (id < 1 || (size_t)id > jt->id_cap)
+    return NULL;
+  return jt->by_id[id - 1];
+}
 
-  for (; (str = strstr(str, needle));) {
-    ptrdiff_t off = str - *haystack;
-    if (sub_len > needle_len) {
-      str = realloc(*haystack, sizeof **haystack * (haystack_len + sub_len - needle_len + 1));
-      if (!str) goto exit;
-      *haystack = str;
-      str = *haystack + off;
-    }
 
-    memmove(str + sub_len, str + needle_len, haystack_len + 1 - off - needle_len);
-    memcpy(str, sub, sub_len);
-    haystack_len = haystack_len + sub_len - needle_len;
-    str += sub_len;
+struct job *job_by_pid(struct job_table *jt, pid_t pid) {
+  struct job *job = jt->pid_count ? jt->by_pid[pid_slot(jt, pid)].job : NULL;
+  for (size_t i = 0; job == NULL && jt->unmapped > 0 && i < jt->id_cap; i++) {
+    struct job *other = jt->by_id[i];
+    for (size_t k = 0; other != NULL && other->state == JOB_RUNNING && k < other->num_pids; k++) {
+      if (other->pids[k] == pid)
+        job = other;
+    }
   }
-  str = *haystack;
-  if (sub_len < needle_len) {
-    str = realloc(*haystack, sizeof **haystack * (haystack_len + 1));
-    if (!str) goto exit;
-    *haystack = str;
+  return job;
+}
+
+
+// Looks up "%n" by job number or a plain pid
+struct job *job_from_spec(struct job_table *jt, char const *spec) {
+  char *end;
+  bool by_number = spec[0] == '%';
+  long value = strtol(spec + by_number, &end, 10);
+  if (*end != '\0' || end == spec + by_number)
+    return NULL;
+  return by_number ? job_by_id(jt, value) : job_by_pid(jt, value);
+}
+
+
+bool job_slot_free(struct job_table *jt) {
+  return jt->limit == 0 || jt->running < jt->limit;
+}
+
+
+// Starts queued jobs, oldest first, while there are free slots
+void schedule_jobs(struct job_table *jt, struct event_loop *ev, struct env_vars *env) {
+  while (jt->queue_head && job_slot_free(jt)) {
+    struct job *job = jt->queue_head;
+    jt->queue_head = job->next_queued;
+    if (jt->queue_head == NULL)
+      jt->queue_tail = NULL;
+    job_launch(jt, ev, env, job, false);
   }
+}
 
-exit:
-  return str;
+
+// Accumulates a reaped child's usage, peak RSS is the largest of the stages
+void rusage_add(struct rusage *total, struct rusage const *ru) {
+  timeradd(&total->ru_utime, &ru->ru_utime, &total->ru_utime);
+  timeradd(&total->ru_stime, &ru->ru_stime, &total->ru_stime);
+  if (ru->ru_maxrss > total->ru_maxrss)
+    total->ru_maxrss = ru->ru_maxrss;
+  total->ru_minflt += ru->ru_minflt;
+  total->ru_majflt += ru->ru_majflt;
 }
 
 
-void print_prompt(struct env_vars *env) {
-  if (env->ps1 != NULL)
-    fprintf(stderr, "%s ", env->ps1);
-  else
-     fprintf(stderr, "$ ");
+static double elapsed_since(struct timespec const *started) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - started->tv_sec) + (now.tv_nsec - started->tv_nsec) / 1e9;
 }
 
 
-void init_env_vars(struct env_vars *env) {
+static double timeval_seconds(struct timeval const *tv) {
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
 
-    const char *PS1 = "PS1";
-    const char *IFS = "IFS";
 
-    char *ps1 = getenv(PS1);
-    char *ifs = getenv(IFS);
+// Output of the "time" prefix, on stderr like the job messages
+void print_time_report(struct timespec const *started, struct rusage const *ru) {
+  fprintf(stderr, "real %.3fs user %.3fs sys %.3fs maxrss %ldKB\n", elapsed_since(started),
+          timeval_seconds(&ru->ru_utime), timeval_seconds(&ru->ru_stime), ru->ru_maxrss);
+}
 
-    char *home_path = getenv("HOME");
 
-    if (home_path == NULL)
-      home_path = strdup(""); // free this!
+// Writes str as a JSON string, returns the new length of out
+static size_t json_string(char *out, size_t len, size_t cap, char const *str) {
+  static char const hex[] = "0123456789abcdef";
+  if (len < cap)
+    out[len] = '"';
+  len++;
+  for (unsigned char const *p = (unsigned char const *)str; *p; p++) {
+    char esc[6];
+    size_t n = 0;
+    if (*p == '"' || *p == '\\') {
+      esc[n++] = '\\';
+      esc[n++] = *p;
+    }
+    else if (*p < 0x20) {
+      memcpy(esc, "\\u00", 4);
+      esc[4] = hex[*p >> 4];
+      esc[5] = hex[*p & 15];
+      n = 6;
+    }
     else {
-      // Append an "/" to the end of the home variable string
-      // char *tmp = (char *)malloc(sizeof(char) * strlen(home_path) + 1);
-      char *tmp = (char *)malloc(sizeof(char) * strlen(home_path) + 1);
-      if (!tmp) {
-        fprintf(stderr, "Error mallocing tmp string for the home_path variable!\n");
-      }
-      strcpy(tmp, home_path);
-      tmp[strlen(home_path)] = '/';
-      tmp[strlen(home_path) + 1] = '\0';
-      
-      strcpy(home_path, tmp);
-      // home_path = tmp;
+      esc[n++] = *p;
     }
-
-    // This should be the PID of smallsh, so will likely need to put this in a struct so we do not overwrite with a child process
-    pid_t process_id = getpid();
-    // Convert to a string
-    char *process_id_str = (char *)malloc(sizeof(char) * 6);
-    //char process_id_str[6];
-    if (sprintf(process_id_str, "%d", process_id) < 0) {
-      fprintf(stderr, "Error converting process_id from pid_t to char */!\n");
-      exit(1);
+    for (size_t i = 0; i < n; i++, len++) {
+      if (len < cap)
+        out[len] = esc[i];
     }
+  }
+  if (len < cap)
+    out[len] = '"';
+  return len + 1;
+}
 
 
-    char *last_fg_exec_return_val = getenv("$?");
-    if (last_fg_exec_return_val == NULL) {
-      // will default to "0"
-      if (!(last_fg_exec_return_val = (char *)malloc(sizeof(char) * 2))) {
-          fprintf(stderr, "Error mallocing for last_fg_exec_return_val!\n");
-          // exit();
-      }
-      last_fg_exec_return_val[0] = '0';
-      last_fg_exec_return_val[1] = '\0';
-    }
+// Writes the start of an accounting record up to the end of argv, returns
+// the length it needs even when that is more than cap
+static size_t json_argv(char *out, size_t cap, char **argv) {
+  size_t len = snprintf(out, cap, "{\"argv\":[");
+  for (int i = 0; argv[i]; i++) {
+    if (i > 0 && len < cap)
+      out[len] = ',';
+    len += i > 0;
+    len = json_string(out, len, cap, argv[i]);
+  }
+  return len;
+}
 
-    char *last_bg_exec_return_val = getenv("$!");
-    if (last_bg_exec_return_val == NULL) {
-      if (!(last_bg_exec_return_val = (char *)malloc(sizeof(char) * 1))) {
-        fprintf(stderr, "Error mallocing for last_bg_exec_return_val!\n");
-        // exit(1);
-      }
-      last_bg_exec_return_val[0] = '\0';
+
+// Appends one JSON line for a finished command to the "set -o acct" file
+void write_acct_record(struct parsed_tokens *stage, pid_t pid, int status, struct timespec const *started,
+                       struct rusage const *ru) {
+
+  // The numbers are formatted once, a second pass over a long argv must not
+  // see the wall time move
+  char tail[512];
+  int exit_status = WIFSIGNALED(status) ? WTERMSIG(status) + 128 : WEXITSTATUS(status);
+  size_t tail_len = snprintf(tail, sizeof tail,
+                             "],\"pid\":%jd,\"status\":%d,\"wall\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+                             "\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld}\n",
+                             (intmax_t)pid, exit_status, elapsed_since(started), timeval_seconds(&ru->ru_utime),
+                             timeval_seconds(&ru->ru_stime), ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt);
+
+  char stack_buf[4096];
+  char *buf = stack_buf;
+  size_t cap = sizeof stack_buf;
+  size_t len = json_argv(buf, cap, stage->input_for_execvp);
+
+  // A long argv gets a buffer of its own, the record still goes out in one
+  // write() so lines from concurrent shells do not interleave
+  if (len + tail_len >= cap) {
+    cap = len + tail_len + 1;
+    buf = malloc(cap);
+    if (buf == NULL) {
+      perror("Error allocating an accounting record");
+      return;
     }
+    json_argv(buf, cap, stage->input_for_execvp);
+  }
+  memcpy(buf + len, tail, tail_len);
+  if (write(acct_fd, buf, len + tail_len) < 0)
+    perror("Accounting write()");
+  if (buf != stack_buf)
+    free(buf);
+}
+
 
-    env->ifs = ifs;
-    env->ps1 = ps1;
-    env->home_path = home_path;
-    env->smallsh_process_id = process_id_str;
-    env->last_fg_exec_return_val = last_fg_exec_return_val;
-    env->last_bg_exec_return_val = last_bg_exec_return_val;
+uint64_t trace_begin(void) {
+  if (!profiling)
+    return 0;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-void update_env_vars_bg_return_vals(struct env_vars *env) {
-  
-  // Free old values first
-  free(env->last_bg_exec_return_val);
 
-  char *last_bg_exec_return_val = getenv("$!");
-  if (last_bg_exec_return_val == NULL) {
-    if (!(last_bg_exec_return_val = (char *)malloc(sizeof(char) * 1))) {
-      fprintf(stderr, "Error mallocing for last_bg_exec_return_val!\n");
-      // exit(1);
+// Histogram bucket of a duration: exact below 8ns, then 8 buckets for each
+// power of two, so a percentile is within 12.5%
+static size_t trace_bucket(uint64_t ns) {
+  if (ns < 8)
+    return ns;
+  int log = 63 - __builtin_clzll(ns);
+  return (log - 2) * 8 + ((ns >> (log - 3)) & 7);
+}
+
+
+// Largest duration that falls in the bucket
+static uint64_t trace_bucket_limit(size_t bucket) {
+  if (bucket < 8)
+    return bucket;
+  int log = bucket / 8 + 2;
+  uint64_t low = (uint64_t)(8 + bucket % 8) << (log - 3);
+  return low + ((uint64_t)1 << (log - 3)) - 1;
+}
+
+
+// Records the phase that began at start in the ring and the histogram.
+// Returns the time it ended, where the next phase can begin.
+uint64_t trace_end(enum trace_phase phase, uint64_t start, char const *detail) {
+
+  // Profiling turned on halfway through a phase has no start for it
+  uint64_t end = trace_begin();
+  if (start == 0 || end == 0)
+    return end;
+  uint64_t duration = end - start;
+  struct trace_event *e = &profiler.events[profiler.recorded++ & (TRACE_EVENTS - 1)];
+  e->start = start;
+  e->duration = duration;
+  e->phase = phase;
+  e->detail[0] = '\0';
+  if (detail != NULL) {
+    strncat(e->detail, detail, TRACE_DETAIL - 1);
+    // A name cut short in the middle of a UTF-8 character loses that character
+    // whole, the JSON stays valid
+    size_t len = strlen(e->detail);
+    if (len == TRACE_DETAIL - 1 && detail[len] != '\0') {
+      size_t lead = len;
+      while (lead > 0 && ((unsigned char)e->detail[lead - 1] & 0xC0) == 0x80)
+        lead--;
+      unsigned char c = lead > 0 ? e->detail[lead - 1] : 0;
+      size_t need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+      if (c >= 0xC0 && len - (lead - 1) < need)
+        e->detail[lead - 1] = '\0';
     }
-    last_bg_exec_return_val[0] = '\0';
   }
 
-  env->last_bg_exec_return_val = last_bg_exec_return_val;
+  profiler.counts[phase][trace_bucket(duration)]++;
+  profiler.total[phase] += duration;
+  if (duration > profiler.max[phase])
+    profiler.max[phase] = duration;
+  return end;
 }
 
 
-void free_env_vars_struct(struct env_vars *env) {
-    free(env->home_path);
-    free(env->smallsh_process_id);
-    free(env->last_fg_exec_return_val);
-    free(env->last_bg_exec_return_val);
+static char const *const phase_names[NUM_PHASES] = {
+  "read", "compile", "expand", "parse", "launch", "wait", "builtin",
+};
+
+
+// Writes the ring as Chrome trace JSON, for chrome://tracing and Perfetto.
+// Returns -1 when the write failed.
+int write_trace(FILE *out) {
+
+  uint64_t first = profiler.recorded > TRACE_EVENTS ? profiler.recorded - TRACE_EVENTS : 0;
+  intmax_t pid = getpid();
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (uint64_t i = first; i < profiler.recorded; i++) {
+    struct trace_event const *e = &profiler.events[i & (TRACE_EVENTS - 1)];
+    char detail[6 * TRACE_DETAIL + 3]; // every byte escaped, the quotes and a NUL
+    detail[json_string(detail, 0, sizeof detail, e->detail)] = '\0';
+    fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%jd,\"tid\":%jd,\"args\":{\"command\":%s}}", i > first ? ",\n" : "",
+            phase_names[e->phase], e->start / 1e3, e->duration / 1e3, pid, pid, detail);
+  }
+  fprintf(out, "\n]}\n");
+  return fflush(out) == EOF || ferror(out) ? -1 : 0;
 }
 
 
-void expand_variables(char **split_words, unsigned int num_words, struct env_vars *env) {
- 
-  for (unsigned int i = 0; i < num_words; i++) {
-    str_gsub(&split_words[i], "~/", env->home_path);
-    str_gsub(&split_words[i], "$$", env->smallsh_process_id);
-    str_gsub(&split_words[i], "$?", env->last_fg_exec_return_val);
-    str_gsub(&split_words[i], "$!", env->last_bg_exec_return_val);
+// SIGUSR1: the trace goes to $TMPDIR/smallsh-trace-PID.json
+void dump_trace(void) {
+
+  char const *dir = getenv("TMPDIR");
+  char path[PATH_MAX];
+  snprintf(path, sizeof path, "%s/smallsh-trace-%jd.json", dir && *dir ? dir : "/tmp", (intmax_t)getpid());
+  FILE *out = fopen(path, "we");
+  if (out == NULL || write_trace(out) < 0)
+    fprintf(stderr, "smallsh: %s: %s\n", path, strerror(errno));
+  else
+    fprintf(stderr, "smallsh: trace written to %s\n", path);
+  if (out != NULL)
+    fclose(out);
+}
+
+
+// "trace" prints the recorded phases as Chrome trace JSON, "trace FILE" writes them there
+void execute_trace_command(struct env_vars *env, struct parsed_tokens *pt) {
+
+  char const *path = pt->cmd_args[0];
+  FILE *out = path ? fopen(path, "we") : stdout;
+  if (out == NULL || write_trace(out) < 0) {
+    fprintf(stderr, "trace: %s: %s\n", path ? path : "stdout", strerror(errno));
+    update_last_fg_status(env, 1 << 8);
+  }
+  if (out != NULL && out != stdout)
+    fclose(out);
+}
+
+
+// "stats" prints count, p50, p99, max and total time of each phase in
+// microseconds, "stats -r" starts over
+void execute_stats_command(struct env_vars *env, struct parsed_tokens *pt) {
+
+  // The ring is left as it is, nothing before recorded is read from it
+  if (pt->cmd_args[0] != NULL && strcmp(pt->cmd_args[0], "-r") == 0) {
+    profiler.recorded = 0;
+    memset(profiler.counts, 0, sizeof profiler.counts);
+    memset(profiler.total, 0, sizeof profiler.total);
+    memset(profiler.max, 0, sizeof profiler.max);
+    return;
+  }
+  if (pt->cmd_args[0] != NULL) {
+    fprintf(stderr, "stats: usage: stats [-r]\n");
+    update_last_fg_status(env, 2 << 8);
+    return;
+  }
+
+  printf("%-8s %10s %10s %10s %10s %12s\n", "phase", "count", "p50_us", "p99_us", "max_us", "total_us");
+  for (int phase = 0; phase < NUM_PHASES; phase++) {
+    uint64_t count = 0;
+    for (size_t b = 0; b < TRACE_BUCKETS; b++)
+      count += profiler.counts[phase][b];
+    double percentiles[2] = {0, 0};
+    uint64_t const wanted[2] = {(count + 1) / 2, count - count / 100};
+    uint64_t seen = 0;
+    for (size_t b = 0, p = 0; b < TRACE_BUCKETS && p < 2 && count > 0; b++) {
+      seen += profiler.counts[phase][b];
+      for (; p < 2 && seen >= wanted[p]; p++) {
+        uint64_t limit = trace_bucket_limit(b);
+        percentiles[p] = (limit < profiler.max[phase] ? limit : profiler.max[phase]) / 1e3;
+      }
+    }
+    printf("%-8s %10ju %10.1f %10.1f %10.1f %12.1f\n", phase_names[phase], (uintmax_t)count,
+           percentiles[0], percentiles[1], profiler.max[phase] / 1e3, profiler.total[phase] / 1e3);
   }
+  fflush(stdout);
 }